@@ -0,0 +1,67 @@
+#ifndef LEG_TRACKER_AFFINITY_TABLE_H
+#define LEG_TRACKER_AFFINITY_TABLE_H
+
+#include <vector>
+#include <leg_tracker/track_index.h>
+
+// Symmetric table of pairwise leg affinities indexed by track slot. A row is
+// recomputed only when the history revision or the generation of its slot
+// changes, values below 0 mark pairs that can not belong to one person.
+class AffinityTable
+{
+
+private:
+  int capacity;
+  std::vector<double> values;
+  std::vector<unsigned int> revisions;
+  std::vector<unsigned int> generations;
+  std::vector<bool> known;
+
+public:
+  AffinityTable() : capacity(0) {}
+
+  void resize(int slots)
+  {
+    if (slots <= capacity) { return; }
+    std::vector<double> new_values(slots * slots, -1.);
+    for (int i = 0; i < capacity; i++)
+    {
+      for (int j = 0; j < capacity; j++)
+      {
+	new_values[i * slots + j] = values[i * capacity + j];
+      }
+    }
+    values.swap(new_values);
+    revisions.resize(slots, 0);
+    generations.resize(slots, 0);
+    known.resize(slots, false);
+    capacity = slots;
+  }
+
+  bool isDirty(const TrackHandle& h, unsigned int revision) const
+  {
+    return h.slot >= capacity || !known[h.slot] || generations[h.slot] != h.generation
+      || revisions[h.slot] != revision;
+  }
+
+  void markClean(const TrackHandle& h, unsigned int revision)
+  {
+    known[h.slot] = true;
+    generations[h.slot] = h.generation;
+    revisions[h.slot] = revision;
+  }
+
+  void set(int slot_a, int slot_b, double value)
+  {
+    values[slot_a * capacity + slot_b] = value;
+    values[slot_b * capacity + slot_a] = value;
+  }
+
+  double get(int slot_a, int slot_b) const
+  {
+    if (slot_a < 0 || slot_b < 0 || slot_a >= capacity || slot_b >= capacity) { return -1.; }
+    return values[slot_a * capacity + slot_b];
+  }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef LEG_TRACKER_BACKGROUND_MODEL_H
+#define LEG_TRACKER_BACKGROUND_MODEL_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+// Static background of a laser scanner that does not move. Every beam keeps
+// two candidate ranges with a hit count, the stronger one is the background
+// of the beam once it was seen min_count times. A new range that matches no
+// candidate replaces the weaker one, and a candidate loses a count for every
+// range that does not match it. A person standing still therefore takes over
+// only after about max_count / 2 scans, and a background that moved away is
+// relearned in the same time.
+class BackgroundModel
+{
+
+private:
+  struct Candidate
+  {
+    float range;
+    int count;
+  };
+
+  struct Beam
+  {
+    Candidate fst;
+    Candidate snd;
+  };
+
+  std::vector<Beam> beams;
+  double tolerance;
+  int min_count;
+  int max_count;
+
+  static void hit(Candidate& c, float range, int max_count)
+  {
+    // running mean over the hits, it keeps adapting slowly once the count is saturated
+    c.range += (range - c.range) / (c.count + 1);
+    c.count = std::min(c.count + 1, max_count);
+  }
+
+public:
+  BackgroundModel(double tolerance = 0.1, int min_count = 100)
+  {
+    configure(tolerance, min_count);
+  }
+
+  void configure(double tolerance, int min_count)
+  {
+    this->tolerance = tolerance;
+    this->min_count = std::max(1, min_count);
+    max_count = 2 * this->min_count;
+    beams.clear();
+  }
+
+  void reset()
+  {
+    beams.clear();
+  }
+
+  // learn the ranges of a scan, ranges outside [range_min, range_max] are skipped
+  void update(const std::vector<float>& ranges, float range_min, float range_max)
+  {
+    if (beams.size() != ranges.size())
+    {
+      Beam b;
+      b.fst.range = b.snd.range = 0.f;
+      b.fst.count = b.snd.count = 0;
+      beams.assign(ranges.size(), b);
+    }
+    for (int i = 0; i < ranges.size(); i++)
+    {
+      float r = ranges[i];
+      if (!(r >= range_min && r <= range_max)) { continue; }
+      Beam& b = beams[i];
+      if (b.fst.count != 0 && std::fabs(r - b.fst.range) <= tolerance)
+      {
+	hit(b.fst, r, max_count);
+	if (b.snd.count > 0) { b.snd.count--; }
+      }
+      else if (b.snd.count != 0 && std::fabs(r - b.snd.range) <= tolerance)
+      {
+	hit(b.snd, r, max_count);
+	if (b.fst.count > 0) { b.fst.count--; }
+      }
+      else
+      {
+	b.snd.range = r;
+	b.snd.count = 1;
+	if (b.fst.count > 0) { b.fst.count--; }
+      }
+      if (b.snd.count > b.fst.count) { std::swap(b.fst, b.snd); }
+    }
+  }
+
+  bool isBackground(int beam, float range) const
+  {
+    if (beam < 0 || beam >= beams.size()) { return false; }
+    const Candidate& c = beams[beam].fst;
+    return c.count >= min_count && std::fabs(range - c.range) <= tolerance;
+  }
+
+  // background range of a beam, NaN while it is not learned
+  float getRange(int beam) const
+  {
+    if (beam < 0 || beam >= beams.size() || beams[beam].fst.count < min_count)
+    {
+      return std::numeric_limits<float>::quiet_NaN();
+    }
+    return beams[beam].fst.range;
+  }
+
+  int size() const
+  {
+    return beams.size();
+  }
+};
+
+#endif
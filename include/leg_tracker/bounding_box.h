@@ -13,7 +13,8 @@ private:
   double x_upper_limit;
   double y_lower_limit;
   double y_upper_limit;
-  int withoutUpdate;
+  // seconds since the last update
+  double withoutUpdate;
   
 public:
   BoundingBox() = delete;
@@ -31,7 +32,7 @@ public:
   
   void update(double fst_leg_x, double fst_leg_y, double snd_leg_x, double snd_leg_y)
   {
-    withoutUpdate = 0;
+    withoutUpdate = 0.;
     
     x_lower_limit = std::min(fst_leg_x, snd_leg_x);
     x_lower_limit -= uncertainty;
@@ -46,14 +47,14 @@ public:
     y_upper_limit += uncertainty;
   }
   
-  void incrementWithoutUpdate()
+  void incrementWithoutUpdate(double dt)
   {
-    withoutUpdate++;
+    withoutUpdate += dt;
   }
   
   bool isWithoutUpdate()
   {
-    return withoutUpdate * 0.05 > 5.0;
+    return withoutUpdate > 5.0;
   }
   
   unsigned int getFstLegId()
@@ -66,22 +67,22 @@ public:
     return snd_leg_id;
   }
   
-  double getXLowerLimit()
+  double getXLowerLimit() const
   {
     return x_lower_limit;
   }
   
-  double getYLowerLimit()
+  double getYLowerLimit() const
   {
     return y_lower_limit;
   }
   
-  double getXUpperLimit()
+  double getXUpperLimit() const
   {
     return x_upper_limit;
   }
   
-  double getYUpperLimit()
+  double getYUpperLimit() const
   {
     return y_upper_limit;
   }
@@ -0,0 +1,166 @@
+#ifndef LEG_TRACKER_CIRCLE_FITTING_H
+#define LEG_TRACKER_CIRCLE_FITTING_H
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <pcl/point_cloud.h>
+
+// Moments of a cluster about its mean, z = x^2 + y^2 of the centered points.
+// All of them are averages over the n points of the cluster. Clusters are
+// given as indices into the cloud, so that no points are copied.
+struct ClusterMoments
+{
+  int n;
+  double mean_x, mean_y;
+  double xx, yy, xy;
+  double xz, yz, zz;
+};
+
+template <typename PointT>
+void computeClusterMoments(const pcl::PointCloud<PointT>& cloud, const std::vector<int>& indices, ClusterMoments& m)
+{
+  m.n = indices.size();
+  m.mean_x = m.mean_y = 0.;
+  m.xx = m.yy = m.xy = m.xz = m.yz = m.zz = 0.;
+  if (m.n == 0) { return; }
+  for (int i = 0; i < m.n; i++)
+  {
+    m.mean_x += cloud.points[indices[i]].x;
+    m.mean_y += cloud.points[indices[i]].y;
+  }
+  m.mean_x /= m.n;
+  m.mean_y /= m.n;
+  for (int i = 0; i < m.n; i++)
+  {
+    double x = cloud.points[indices[i]].x - m.mean_x;
+    double y = cloud.points[indices[i]].y - m.mean_y;
+    double z = x * x + y * y;
+    m.xx += x * x;
+    m.yy += y * y;
+    m.xy += x * y;
+    m.xz += x * z;
+    m.yz += y * z;
+    m.zz += z * z;
+  }
+  m.xx /= m.n; m.yy /= m.n; m.xy /= m.n;
+  m.xz /= m.n; m.yz /= m.n; m.zz /= m.n;
+}
+
+// algebraic fit minimizing sum((x - a)^2 + (y - b)^2 - r^2)^2, biased to
+// smaller circles on short arcs
+inline bool fitCircleKasa(const ClusterMoments& m, double& cx, double& cy, double& r)
+{
+  if (m.n < 3) { return false; }
+  double det = m.xx * m.yy - m.xy * m.xy;
+  if (std::fabs(det) < 1e-12) { return false; }
+  double a = (m.yy * m.xz - m.xy * m.yz) / (2. * det);
+  double b = (m.xx * m.yz - m.xy * m.xz) / (2. * det);
+  cx = m.mean_x + a;
+  cy = m.mean_y + b;
+  r = std::sqrt(a * a + b * b + m.xx + m.yy);
+  return true;
+}
+
+// Taubin fit, the root of its characteristic polynomial is found by newton
+// iterations starting at zero (Chernov, Circular and Linear Regression)
+inline bool fitCircleTaubin(const ClusterMoments& m, double& cx, double& cy, double& r)
+{
+  if (m.n < 3) { return false; }
+  double mz = m.xx + m.yy;
+  double cov_xy = m.xx * m.yy - m.xy * m.xy;
+  double var_z = m.zz - mz * mz;
+  double a3 = 4. * mz;
+  double a2 = -3. * mz * mz - m.zz;
+  double a1 = var_z * mz + 4. * cov_xy * mz - m.xz * m.xz - m.yz * m.yz;
+  double a0 = m.xz * (m.xz * m.yy - m.yz * m.xy) + m.yz * (m.yz * m.xx - m.xz * m.xy) - var_z * cov_xy;
+  double a22 = a2 + a2;
+  double a33 = a3 + a3 + a3;
+
+  double x = 0., y = a0;
+  for (int iter = 0; iter < 20; iter++)
+  {
+    double dy = a1 + x * (a22 + a33 * x);
+    if (dy == 0.) { break; }
+    double x_new = x - y / dy;
+    if (x_new == x || !std::isfinite(x_new)) { break; }
+    double y_new = a0 + x_new * (a1 + x_new * (a2 + x_new * a3));
+    if (std::fabs(y_new) >= std::fabs(y)) { break; }
+    x = x_new;
+    y = y_new;
+  }
+
+  double det = x * x - x * mz + cov_xy;
+  if (std::fabs(det) < 1e-12) { return false; }
+  double a = (m.xz * (m.yy - x) - m.yz * m.xy) / (2. * det);
+  double b = (m.yz * (m.xx - x) - m.xz * m.xy) / (2. * det);
+  cx = m.mean_x + a;
+  cy = m.mean_y + b;
+  r = std::sqrt(a * a + b * b + mz);
+  return std::isfinite(r);
+}
+
+// circle through three points, false for (nearly) collinear points
+inline bool circleThroughPoints(double x1, double y1, double x2, double y2, double x3, double y3,
+  double& cx, double& cy, double& r)
+{
+  double d = 2. * (x1 * (y2 - y3) + x2 * (y3 - y1) + x3 * (y1 - y2));
+  if (std::fabs(d) < 1e-12) { return false; }
+  double s1 = x1 * x1 + y1 * y1, s2 = x2 * x2 + y2 * y2, s3 = x3 * x3 + y3 * y3;
+  cx = (s1 * (y2 - y3) + s2 * (y3 - y1) + s3 * (y1 - y2)) / d;
+  cy = (s1 * (x3 - x2) + s2 * (x1 - x3) + s3 * (x2 - x1)) / d;
+  r = std::sqrt(std::pow(x1 - cx, 2) + std::pow(y1 - cy, 2));
+  return true;
+}
+
+// RANSAC over circles through three points with a radius in [min_r, max_r], the
+// circle with most inliers is refined by a Taubin fit on its inliers
+template <typename PointT>
+bool fitCircleRansac(const pcl::PointCloud<PointT>& cloud, const std::vector<int>& indices, double dist_threshold, 
+  int max_iterations, double min_r, double max_r, double& cx, double& cy, double& r)
+{
+  int n = indices.size();
+  if (n < 3) { return false; }
+  int best_inliers = 0;
+  double best_cx = 0., best_cy = 0., best_r = 0.;
+  for (int iter = 0; iter < max_iterations; iter++)
+  {
+    int i = indices[std::rand() % n], j = indices[std::rand() % n], k = indices[std::rand() % n];
+    if (i == j || j == k || i == k) { continue; }
+    double x, y, radius;
+    if (!circleThroughPoints(cloud.points[i].x, cloud.points[i].y, cloud.points[j].x, cloud.points[j].y,
+      cloud.points[k].x, cloud.points[k].y, x, y, radius)) { continue; }
+    if (radius < min_r || radius > max_r) { continue; }
+    int inliers = 0;
+    for (int p = 0; p < n; p++)
+    {
+      const PointT& q = cloud.points[indices[p]];
+      double dist = std::sqrt(std::pow(q.x - x, 2) + std::pow(q.y - y, 2));
+      if (std::fabs(dist - radius) <= dist_threshold) { inliers++; }
+    }
+    if (inliers > best_inliers)
+    {
+      best_inliers = inliers;
+      best_cx = x; best_cy = y; best_r = radius;
+      if (inliers == n) { break; }
+    }
+  }
+  if (best_inliers < 3) { return false; }
+
+  std::vector<int> inliers;
+  for (int p = 0; p < n; p++)
+  {
+    const PointT& q = cloud.points[indices[p]];
+    double dist = std::sqrt(std::pow(q.x - best_cx, 2) + std::pow(q.y - best_cy, 2));
+    if (std::fabs(dist - best_r) <= dist_threshold) { inliers.push_back(indices[p]); }
+  }
+  ClusterMoments m;
+  computeClusterMoments(cloud, inliers, m);
+  if (!fitCircleTaubin(m, cx, cy, r))
+  {
+    cx = best_cx; cy = best_cy; r = best_r;
+  }
+  return true;
+}
+
+#endif
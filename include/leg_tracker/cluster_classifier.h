@@ -0,0 +1,158 @@
+#ifndef LEG_TRACKER_CLUSTER_CLASSIFIER_H
+#define LEG_TRACKER_CLUSTER_CLASSIFIER_H
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <pcl/point_cloud.h>
+#include <leg_tracker/circle_fitting.h>
+
+// geometric features of a cluster, all in meters unless noted
+struct ClusterFeatures
+{
+  // distance between the first and the last point in scan order
+  double width;
+  // 1 - smallest / largest eigenvalue of the point covariance, 1 for a line
+  double linearity;
+  // radius of the taubin circle and the rms distance of the points to it
+  double radius;
+  double circularity;
+  // number of points times range, about constant for an object at any range
+  double points_times_range;
+  // smaller of the two range jumps to the neighbouring points, positive if they are farther away,
+  // clamped to [-1, 1]. A neighbour without a valid return counts as 1.
+  double boundary_jump;
+};
+
+// Clusters of a cloud in scan order with their indices sorted. Everything
+// except the boundary jumps is taken from the moments of the cluster.
+template <typename PointT>
+void computeClusterFeatures(const pcl::PointCloud<PointT>& cloud, const std::vector<int>& indices,
+  const ClusterMoments& m, ClusterFeatures& f)
+{
+  const PointT& first = cloud.points[indices.front()];
+  const PointT& last = cloud.points[indices.back()];
+  f.width = std::sqrt(std::pow(first.x - last.x, 2) + std::pow(first.y - last.y, 2));
+
+  double trace = m.xx + m.yy;
+  double det = m.xx * m.yy - m.xy * m.xy;
+  double disc = std::sqrt(std::max(0., trace * trace / 4. - det));
+  double l_max = trace / 2. + disc;
+  double l_min = trace / 2. - disc;
+  f.linearity = l_max > 0. ? 1. - std::max(0., l_min) / l_max : 0.;
+
+  double cx, cy;
+  f.radius = 0.;
+  f.circularity = 1.;
+  if (fitCircleTaubin(m, cx, cy, f.radius) && f.radius > 0.)
+  {
+    // algebraic residual (z - 2au - 2bv + c) from the moments, over 2r it is about the geometric one
+    double a = cx - m.mean_x, b = cy - m.mean_y;
+    double c = a * a + b * b - f.radius * f.radius;
+    double res = m.zz + 4. * a * a * m.xx + 4. * b * b * m.yy + 8. * a * b * m.xy
+      - 4. * a * m.xz - 4. * b * m.yz + 2. * c * trace + c * c;
+    f.circularity = std::sqrt(std::max(0., res)) / (2. * f.radius);
+  }
+
+  double range = std::sqrt(m.mean_x * m.mean_x + m.mean_y * m.mean_y);
+  f.points_times_range = m.n * range;
+
+  double range_first = std::sqrt(first.x * first.x + first.y * first.y);
+  double range_last = std::sqrt(last.x * last.x + last.y * last.y);
+  // a side at the end of the scan or without a valid return counts as far background, the clamped 1
+  double jump_prev = 1., jump_next = 1.;
+  if (indices.front() > 0)
+  {
+    const PointT& prev = cloud.points[indices.front() - 1];
+    double jump = std::sqrt(prev.x * prev.x + prev.y * prev.y) - range_first;
+    if (std::isfinite(jump)) { jump_prev = jump; }
+  }
+  if (indices.back() + 1 < cloud.points.size())
+  {
+    const PointT& next = cloud.points[indices.back() + 1];
+    double jump = std::sqrt(next.x * next.x + next.y * next.y) - range_last;
+    if (std::isfinite(jump)) { jump_next = jump; }
+  }
+  f.boundary_jump = std::max(-1., std::min(1., std::min(jump_prev, jump_next)));
+}
+
+// Logistic model on the cluster features. The model file has one
+// "name value" pair per line for bias, threshold and the feature weights,
+// lines starting with # are comments.
+class ClusterClassifier
+{
+
+private:
+  bool loaded;
+  double bias;
+  double threshold;
+  double w_width, w_linearity, w_radius, w_circularity, w_points_times_range, w_boundary_jump;
+
+public:
+  ClusterClassifier()
+  {
+    loaded = false;
+    bias = 0.;
+    threshold = 0.5;
+    w_width = w_linearity = w_radius = w_circularity = w_points_times_range = w_boundary_jump = 0.;
+  }
+
+  bool load(const std::string& file)
+  {
+    loaded = false;
+    std::ifstream in(file.c_str());
+    if (!in.is_open()) { return false; }
+    std::map<std::string, double> values;
+    std::string line;
+    while (std::getline(in, line))
+    {
+      if (line.empty() || line[0] == '#') { continue; }
+      std::istringstream ss(line);
+      std::string name;
+      double value;
+      if (!(ss >> name >> value)) { return false; }
+      values[name] = value;
+    }
+    const char* names[] = {"bias", "threshold", "width", "linearity", "radius", "circularity",
+      "points_times_range", "boundary_jump"};
+    for (int i = 0; i < 8; i++)
+    {
+      if (values.find(names[i]) == values.end()) { return false; }
+    }
+    bias = values["bias"];
+    threshold = values["threshold"];
+    w_width = values["width"];
+    w_linearity = values["linearity"];
+    w_radius = values["radius"];
+    w_circularity = values["circularity"];
+    w_points_times_range = values["points_times_range"];
+    w_boundary_jump = values["boundary_jump"];
+    loaded = true;
+    return true;
+  }
+
+  bool isLoaded() const
+  {
+    return loaded;
+  }
+
+  // probability of the cluster being a leg
+  double score(const ClusterFeatures& f) const
+  {
+    double s = bias + w_width * f.width + w_linearity * f.linearity + w_radius * f.radius
+      + w_circularity * f.circularity + w_points_times_range * f.points_times_range
+      + w_boundary_jump * f.boundary_jump;
+    return 1. / (1. + std::exp(-s));
+  }
+
+  bool isLeg(const ClusterFeatures& f) const
+  {
+    return !loaded || score(f) >= threshold;
+  }
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef LEG_TRACKER_HEIGHT_BAND_SCAN_H
+#define LEG_TRACKER_HEIGHT_BAND_SCAN_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+
+// Pseudo scan of a multi-layer lidar in the frame of the cloud. The points
+// with z + sensor_height in [z_min, z_max] are binned by azimuth over the
+// full circle and every bin keeps its closest range, empty bins get +inf.
+// Everything is done in one pass over the cloud, the azimuth is computed
+// only for points inside the band and the range limits.
+inline bool heightBandToScan(const sensor_msgs::PointCloud2& cloud, double sensor_height, double z_min, double z_max,
+  double angle_increment, double range_min, double range_max, sensor_msgs::LaserScan& scan)
+{
+  if (angle_increment <= 0.) { return false; }
+  int bins = std::ceil(2. * M_PI / angle_increment);
+  scan.header = cloud.header;
+  scan.angle_min = -M_PI;
+  scan.angle_increment = angle_increment;
+  scan.angle_max = scan.angle_min + (bins - 1) * angle_increment;
+  scan.time_increment = 0.;
+  scan.scan_time = 0.;
+  scan.range_min = range_min;
+  scan.range_max = range_max;
+  scan.ranges.assign(bins, std::numeric_limits<float>::infinity());
+  scan.intensities.clear();
+
+  if (cloud.width * cloud.height == 0) { return true; }
+  float lower = z_min - sensor_height, upper = z_max - sensor_height;
+  float min_sq = range_min * range_min, max_sq = range_max * range_max;
+  float inverse_increment = 1. / angle_increment;
+  float* ranges = &scan.ranges[0];
+
+  sensor_msgs::PointCloud2ConstIterator<float> iter_x(cloud, "x"), iter_y(cloud, "y"), iter_z(cloud, "z");
+  for (; iter_x != iter_x.end(); ++iter_x, ++iter_y, ++iter_z)
+  {
+    float x = *iter_x, y = *iter_y, z = *iter_z;
+    float range_sq = x * x + y * y;
+    // false for NaN points as well
+    if (!(z >= lower && z <= upper && range_sq >= min_sq && range_sq <= max_sq)) { continue; }
+    int bin = (std::atan2(y, x) + M_PI) * inverse_increment;
+    if (bin >= bins) { bin = bins - 1; }
+    float range = std::sqrt(range_sq);
+    if (range < ranges[bin]) { ranges[bin] = range; }
+  }
+  return true;
+}
+
+#endif
@@ -2,13 +2,27 @@
 #ifndef LEG_TRACKER_LEG_H
 #define LEG_TRACKER_LEG_H
 
-#include <iirob_filters/kalman_filter.h>
+#include <ros/ros.h>
 #include <pcl/point_types.h>
 #include <list>
+#include <leg_tracker/track_index.h>
+#include <leg_tracker/ring_buffer.h>
+#include <leg_tracker/leg_filter.h>
 
 
 typedef pcl::PointXYZ Point;
-typedef iirob_filters::MultiChannelKalmanFilter<double> KalmanFilter;
+// unaligned, so that Leg can be stored by value in std::vector
+typedef Eigen::Matrix<double, 2, 2, Eigen::DontAlign> Cov2d;
+
+struct HistoryEntry
+{
+  double x;
+  double y;
+};
+
+// longest history a leg keeps, min_observations is clamped to it
+static const int max_history_size = 16;
+typedef RingBuffer<HistoryEntry, max_history_size> LegHistory;
 
 class Leg
 {
@@ -16,27 +30,110 @@ class Leg
 private:
   unsigned int legId;
   unsigned int peopleId;
-  KalmanFilter* filter;
+  TrackHandle handle;
+  LegFilter filter;
+  // predicted to an older stamp than the filter for a late scan, see predict
+  bool late;
+  double late_stamp;
   Point pos;
   Point vel, acc;
   int observations;
   bool hasPair_;
   int min_observations;
-  std::vector<std::vector<double> > history;
+  LegHistory history;
+  unsigned int history_revision;
   int occluded_age;
   int occluded_dead_age;
   double variance_observation;
   int state_dimensions;
   double distance_traveled;
   Eigen::MatrixXd cov;
+  // stamp the leg was last predicted to and of its last update
+  double stamp;
+  double last_update_stamp;
+  // innovation covariance S = C * P * C^T + R and its inverse, cached once per predict/update
+  Cov2d S;
+  Cov2d S_inv;
   double min_dist_travelled;
+  // stance: the leg stands still, only its position is corrected and the filter is not run
+  bool stance;
+  double vel_stance_threshold;
+  double vel_swing_threshold;
+  double dt;
+  // consecutive updates below vel_stance_threshold before the leg enters the stance
+  int stance_entry_updates;
+  int slow_updates;
+  double stance_pos_var;
+  double stance_meas_var;
+  const LegFilterParams* filter_params;
+
+  void updateStanceInnovationCov()
+  {
+    S.setZero();
+    S(0, 0) = S(1, 1) = stance_pos_var + stance_meas_var;
+    S_inv.setZero();
+    S_inv(0, 0) = S_inv(1, 1) = 1. / S(0, 0);
+  }
+
+  void enterStance()
+  {
+    stance = true;
+    slow_updates = 0;
+    stance_pos_var = std::max(cov(0, 0), cov(1, 1));
+    stance_meas_var = std::max(S(0, 0) - cov(0, 0), 1e-4);
+    vel.x = vel.y = 0.;
+    acc.x = acc.y = 0.;
+    updateStanceInnovationCov();
+  }
+
+  // The filter was not run during the stance, it starts again from the stance position at
+  // seed_stamp with the velocity (vx, vy) and is predicted to the current stamp, so that the
+  // next update corrects the velocity as well.
+  void leaveStance(double vx, double vy, double seed_stamp)
+  {
+    stance = false;
+    filter.init(filter_params, pos.x, pos.y, std::min(seed_stamp, stamp), vx, vy);
+    filter.predict(stamp);
+    setFromFilter();
+  }
+
+  // position, velocity, acceleration and covariances from the current state of the filter
+  void setFromFilter()
+  {
+    const LegState& x = filter.getState();
+    pos.x = x(0);
+    pos.y = x(1);
+    vel.x = x(2);
+    vel.y = x(3);
+    acc.x = x(4);
+    acc.y = x(5);
+    cov = filter.getCov();
+    S = filter.getInnovationCov();
+    updateInnovationCovInverse();
+  }
+
+  void updateInnovationCovInverse()
+  {
+    double det = S(0, 0) * S(1, 1) - S(0, 1) * S(1, 0);
+    if (det <= 1e-12)
+    {
+      ROS_ERROR("Leg.h: Innovation covariance is singular!");
+      S_inv.setIdentity();
+      return;
+    }
+    S_inv(0, 0) = S(1, 1) / det;
+    S_inv(0, 1) = -S(0, 1) / det;
+    S_inv(1, 0) = -S(1, 0) / det;
+    S_inv(1, 1) = S(0, 0) / det;
+  }
 
 public:
   Leg() = delete;
 
-  Leg(unsigned int legId, const Point& pos, int occluded_dead_age = 10,
+  Leg(unsigned int legId, const Point& pos, double stamp, const LegFilterParams* filter_params, int occluded_dead_age = 10,
     double variance_observation = 0.25, int min_observations = 4,
-    int state_dimensions = 6, double min_dist_travelled = 0.25)
+    int state_dimensions = 6, double min_dist_travelled = 0.25,
+    double vel_stance_threshold = 0., double vel_swing_threshold = 0., double dt = 0.05, int stance_entry_updates = 3)
   {
     this->legId = legId;
     occluded_age = 0;
@@ -46,60 +143,87 @@ public:
     this->min_observations = min_observations;
     this->state_dimensions = state_dimensions;
     this->min_dist_travelled = min_dist_travelled;
+    this->vel_stance_threshold = vel_stance_threshold;
+    this->vel_swing_threshold = vel_swing_threshold;
+    this->dt = dt;
+    this->stance_entry_updates = stance_entry_updates;
+    slow_updates = 0;
+    this->stamp = stamp;
+    last_update_stamp = stamp;
+    this->filter_params = filter_params;
+    late = false;
+    late_stamp = stamp;
+    stance = false;
+    stance_pos_var = 0.;
+    stance_meas_var = 0.;
     
-    history.resize(min_observations);
-    for (int i = 0; i < min_observations; i++) { history[i].resize(state_dimensions); }
+    history = LegHistory(min_observations);
+    history_revision = 0;
+    HistoryEntry e;
+    e.x = pos.x;
+    e.y = pos.y;
+    history.push(e);
 
     peopleId = -1;
     hasPair_ = false;
     observations = 1;
     distance_traveled = 0.;
 
-    std::vector<double> in;
-    // position
-    in.push_back(pos.x); in.push_back(pos.y);
-    // velocity
-    in.push_back(0.0); in.push_back(0.0);
-    // acceleration
-    in.push_back(0.0); in.push_back(0.0);
-
-    filter = new KalmanFilter();
-    if (!filter->configure(in)) { ROS_ERROR("Leg.h: Configure of filter has failed!"); }
-    filter->getErrorCovarianceMatrix(cov);
+    filter.init(filter_params, pos.x, pos.y, stamp);
+    setFromFilter();
   }
 
   unsigned int getLegId()
   {
     return legId;
   }
+
+  const TrackHandle& getHandle() const
+  {
+    return handle;
+  }
+
+  void setHandle(const TrackHandle& h)
+  {
+    handle = h;
+  }
   
   void resetErrorCovAndState()
   {
-    filter->resetErrorCovAndState();
-  }
-
-  bool is_within_region(const Point& p, double std)
-  {
-    Eigen::VectorXd in(2);
-    in << p.x, p.y;
-    Eigen::VectorXd state(2);
-    state << pos.x, pos.y;
-    Eigen::MatrixXd B;
-    if (!filter->getGatingMatrix(B)) { return false; }
-    Eigen::VectorXd diff = in - state;
-    Eigen::MatrixXd dist_mat = diff.transpose() * B.inverse() * diff;
-    double dist = dist_mat(0,0);
-    ROS_INFO("\nis_within_region state (%f, %f) and Point (%f, %f) and dist: %f", 
-	     pos.x, pos.y, p.x, p.y, dist);
-    if (dist <= std) {
-         return true;
-    } else {
-         return false;
-    }
+    if (stance) { leaveStance(0., 0., stamp); }
+    filter.resetCov();
+    setFromFilter();
+  }
+
+  // squared mahalanobis distance of p to the predicted position
+  double mahalanobisDistSquared(const Point& p) const
+  {
+    double dx = p.x - pos.x;
+    double dy = p.y - pos.y;
+    return dx * (S_inv(0, 0) * dx + S_inv(0, 1) * dy) + dy * (S_inv(1, 0) * dx + S_inv(1, 1) * dy);
+  }
+
+  double mahalanobisDist(const Point& p) const
+  {
+    return std::sqrt(mahalanobisDistSquared(p));
   }
 
-  void missed()
+  bool is_within_region(const Point& p, double std) const
   {
+    return mahalanobisDistSquared(p) <= std;
+  }
+
+  // in_view is false for a scan of a sensor that can not see the leg, it only keeps the prediction
+  void missed(bool in_view = true)
+  {
+    // a late scan that did not see the leg does not make it older
+    if (late)
+    {
+      late = false;
+      setFromFilter();
+      return;
+    }
+    if (!in_view) { return; }
     if (occluded_age <= occluded_dead_age)
     {
       occluded_age++;
@@ -116,82 +240,164 @@ public:
   {
     return cov;
   }
-  
-  double getCov() 
+
+  const Cov2d& getInnovationCov() const
   {
-    return cov(0, 0);
+    return S;
   }
 
-  double getMeasToTrackMatchingCov()
+  const Cov2d& getInnovationCovInverse() const
   {
-    double result = cov(0, 0); 
-//     result += variance_observation;
-    return result;
+    return S_inv;
   }
 
   bool is_dead()
   {
-      if (occluded_age > occluded_dead_age) {
+      // occluded_dead_age scans at the nominal period, whatever the actual rate is
+      if (stamp - last_update_stamp > occluded_dead_age * dt) {
            return true;
       }
       return false;
   }
 
-  void predict()
+  // Predicts to the stamp of a scan. A stamp older than the last one comes from a late scan: 
+  // the position and the gate are set to the prior at that stamp until update or missed.
+  void predict(double stamp)
   {
-    std::vector<double> prediction;
-    filter->predict(prediction);
-    if (prediction.size() != state_dimensions) { ROS_ERROR("Leg.h: Prediction vector size is too small!"); return; }
-    pos.x = prediction[0];
-    pos.y = prediction[1];
-    vel.x = prediction[2];
-    vel.y = prediction[3];
-    acc.x = prediction[4];
-    acc.y = prediction[5];
-    filter->getErrorCovarianceMatrix(cov);
+    if (late) { setFromFilter(); }
+    late = false;
+    if (stance)
+    {
+      // random walk of the position, bounded by the stance velocity
+      if (stamp <= this->stamp) { return; }
+      stance_pos_var += std::pow(vel_stance_threshold * (stamp - this->stamp), 2);
+      this->stamp = stamp;
+      updateStanceInnovationCov();
+      return;
+    }
+    if (stamp < this->stamp)
+    {
+      LegState x;
+      LegStateCov P;
+      if (!filter.priorAt(stamp, x, P)) { return; }
+      late = true;
+      late_stamp = stamp;
+      pos.x = x(0);
+      pos.y = x(1);
+      cov = P;
+      S = P.topLeftCorner<2, 2>() + filter_params->R;
+      updateInnovationCovInverse();
+      return;
+    }
+    this->stamp = stamp;
+    filter.predict(stamp);
+    setFromFilter();
   }
   
   bool getCurrentState(std::vector<double>& out)
   {
-    return filter->getCurrentState(out);
+    out.clear();
+    out.push_back(pos.x); out.push_back(pos.y);
+    out.push_back(vel.x); out.push_back(vel.y);
+    out.push_back(acc.x); out.push_back(acc.y);
+    return true;
   }
 
   void update(const Point& p)
   {
-    std::vector<double> in, out;
-    in.push_back(p.x); in.push_back(p.y);
-    filter->update(in, out);
-    if (out.size() != state_dimensions) { ROS_ERROR("Leg.h: Update out vector size is too small!"); return; }
+    if (stance)
+    {
+      double stance_dt = std::max(dt, stamp - last_update_stamp);
+      double dist = std::sqrt(std::pow(p.x - pos.x, 2) + std::pow(p.y - pos.y, 2));
+      if (dist <= vel_swing_threshold * stance_dt)
+      {
+	updateStance(p);
+	return;
+      }
+      // the displacement since the last stance update gives the velocity the leg swings with
+      leaveStance((p.x - pos.x) / stance_dt, (p.y - pos.y) / stance_dt, stamp - stance_dt);
+    }
+    Point prev = pos;
+    if (late) 
+    { 
+      late = false;
+      // pos is the prior at the late stamp, the distance is taken from the current state
+      prev.x = filter.getState()(0);
+      prev.y = filter.getState()(1);
+      if (!filter.updateLate(late_stamp, p.x, p.y)) { setFromFilter(); return; }
+    }
+    else
+    {
+      filter.update(p.x, p.y);
+    }
+    setFromFilter();
     if (distance_traveled <= min_dist_travelled)
     {
-      double delta_dist_travelled = std::sqrt(std::pow((pos.x - out[0]), 2) + std::pow((pos.y - out[1]), 2));
+      double delta_dist_travelled = std::sqrt(std::pow((prev.x - pos.x), 2) + std::pow((prev.y - pos.y), 2));
       if (delta_dist_travelled > 0.01) { distance_traveled += delta_dist_travelled; }
     }
-    pos.x = out[0];
-    pos.y = out[1];
-    vel.x = out[2];
-    vel.y = out[3];
-    acc.x = out[4];
-    acc.y = out[5];
-    filter->getErrorCovarianceMatrix(cov);
+    std::vector<double> out;
+    getCurrentState(out);
     updateHistory(out);
     occluded_age = 0;
+    last_update_stamp = stamp;
     if (observations < min_observations) { observations++; }
 //     history.pop_back(); // remove last prediction becaufe there is an update
+    if (vel_stance_threshold > 0. && std::sqrt(vel.x * vel.x + vel.y * vel.y) < vel_stance_threshold)
+    {
+      if (++slow_updates >= stance_entry_updates) { enterStance(); }
+    }
+    else
+    {
+      slow_updates = 0;
+    }
+  }
+
+  // position only correction of a standing leg, velocity and acceleration stay zero
+  void updateStance(const Point& p)
+  {
+    double k = stance_pos_var / (stance_pos_var + stance_meas_var);
+    double x = pos.x + k * (p.x - pos.x);
+    double y = pos.y + k * (p.y - pos.y);
+    stance_pos_var *= (1. - k);
+    if (distance_traveled <= min_dist_travelled)
+    {
+      double delta_dist_travelled = std::sqrt(std::pow((pos.x - x), 2) + std::pow((pos.y - y), 2));
+      if (delta_dist_travelled > 0.01) { distance_traveled += delta_dist_travelled; }
+    }
+    pos.x = x;
+    pos.y = y;
+    updateStanceInnovationCov();
+    HistoryEntry e;
+    e.x = x;
+    e.y = y;
+    history.push(e);
+    history_revision++;
+    occluded_age = 0;
+    last_update_stamp = stamp;
+    if (observations < min_observations) { observations++; }
   }
 
   void updateHistory(const std::vector<double>& new_state)
   {
-    if (observations >= history.size() || observations < 0 
-	|| new_state.size() != state_dimensions) { return; }
-    for (int i = 0; i < state_dimensions; i++) { history[observations][i] = new_state[i]; }
+    if (new_state.size() != state_dimensions) { return; }
+    HistoryEntry e;
+    e.x = new_state[0];
+    e.y = new_state[1];
+    history.push(e);
+    history_revision++;
   }
 
-  std::vector<std::vector<double> > getHistory() const
+  const LegHistory& getHistory() const
   {
     return history;
   }
 
+  unsigned int getHistoryRevision() const
+  {
+    return history_revision;
+  }
+
   Point getPos()
   {
     return pos;
@@ -238,17 +444,18 @@ public:
 
    bool getGatingMatrix(Eigen::MatrixXd& data_out)
   {
-    if (!filter->getGatingMatrix(data_out)) { return false; }
+    data_out = S;
     return true;
   }
 
   double likelihood(const double& x, const double& y)
   {
-    std::vector<double> in;
-    in.push_back(x); in.push_back(y);
-    double out = 0.;
-    if (!filter->likelihood(in, out)) { ROS_ERROR("Leg.h: Likelihood failed!"); return false; }
-    return out;
+    Point p;
+    p.x = x;
+    p.y = y;
+    double det = S(0, 0) * S(1, 1) - S(0, 1) * S(1, 0);
+    if (det <= 1e-12) { ROS_ERROR("Leg.h: Likelihood failed!"); return 0.; }
+    return std::exp(-0.5 * mahalanobisDistSquared(p)) / (2. * M_PI * std::sqrt(det));
   }
 
   double getConfidence()
@@ -0,0 +1,224 @@
+#ifndef LEG_TRACKER_LEG_FILTER_H
+#define LEG_TRACKER_LEG_FILTER_H
+
+#include <cmath>
+#include <Eigen/Core>
+#include <Eigen/LU>
+
+// unaligned, so that the filter can be stored by value in Leg
+typedef Eigen::Matrix<double, 6, 1, Eigen::DontAlign> LegState;
+typedef Eigen::Matrix<double, 6, 6, Eigen::DontAlign> LegStateCov;
+typedef Eigen::Matrix<double, 2, 2, Eigen::DontAlign> LegMeasCov;
+
+// noise of the constant acceleration model, from the KalmanFilter parameters
+struct LegFilterParams
+{
+  // period Q is given for, only its diagonal is used
+  double dt;
+  LegStateCov Q;
+  LegMeasCov R;
+  LegStateCov P0;
+};
+
+// Constant acceleration Kalman filter of a leg with the state
+// (x, y, vx, vy, ax, ay), predicted to the stamp of each scan. The last
+// steps are kept with their measurements, so that a measurement older than
+// the current stamp is filtered in at its place and the newer steps are
+// applied again on top of it.
+class LegFilter
+{
+
+public:
+  static const int max_steps = 8;
+
+private:
+  struct Step
+  {
+    double stamp;
+    bool measured;
+    double zx, zy;
+    // posterior after the step
+    LegState x;
+    LegStateCov P;
+  };
+
+  const LegFilterParams* params;
+  // oldest first, the last one is the current state
+  Step steps[max_steps];
+  int n_steps;
+
+  // Q(dt) = integral of A(s) * Qc * A(s)^T over [0, dt] for the white noise Qc = diag(Q) / params.dt
+  // on position, velocity and acceleration, in closed form per axis
+  static void processNoise(const LegFilterParams& params, double dt, LegStateCov& Q)
+  {
+    Q.setZero();
+    double dt2 = dt * dt, dt3 = dt2 * dt;
+    for (int axis = 0; axis < 2; axis++)
+    {
+      int p = axis, v = axis + 2, a = axis + 4;
+      double qp = params.Q(p, p) / params.dt, qv = params.Q(v, v) / params.dt, qa = params.Q(a, a) / params.dt;
+      Q(p, p) = qp * dt + qv * dt3 / 3. + qa * dt3 * dt2 / 20.;
+      Q(p, v) = Q(v, p) = qv * dt2 / 2. + qa * dt2 * dt2 / 8.;
+      Q(p, a) = Q(a, p) = qa * dt3 / 6.;
+      Q(v, v) = qv * dt + qa * dt3 / 3.;
+      Q(v, a) = Q(a, v) = qa * dt2 / 2.;
+      Q(a, a) = qa * dt;
+    }
+  }
+
+  static void predictStep(const LegFilterParams& params, double dt, LegState& x, LegStateCov& P)
+  {
+    if (dt <= 0.) { return; }
+    LegStateCov A = LegStateCov::Identity();
+    A(0, 2) = A(1, 3) = A(2, 4) = A(3, 5) = dt;
+    A(0, 4) = A(1, 5) = 0.5 * dt * dt;
+    LegStateCov Q;
+    processNoise(params, dt, Q);
+    x = A * x;
+    P = A * P * A.transpose() + Q;
+  }
+
+  static void updateStep(const LegFilterParams& params, double zx, double zy, LegState& x, LegStateCov& P)
+  {
+    // C selects the position, so C * P * C^T and P * C^T are blocks of P
+    LegMeasCov S = P.topLeftCorner<2, 2>() + params.R;
+    Eigen::Matrix<double, 6, 2, Eigen::DontAlign> K = P.leftCols<2>() * S.inverse();
+    Eigen::Vector2d y(zx - x(0), zy - x(1));
+    x += K * y;
+    P -= K * P.topRows<2>();
+  }
+
+  void push(const Step& s)
+  {
+    if (n_steps == max_steps)
+    {
+      for (int k = 1; k < max_steps; k++) { steps[k - 1] = steps[k]; }
+      n_steps--;
+    }
+    steps[n_steps++] = s;
+  }
+
+public:
+  LegFilter() : params(0), n_steps(0) {}
+
+  void init(const LegFilterParams* params, double x, double y, double stamp, double vx = 0., double vy = 0.)
+  {
+    this->params = params;
+    Step s;
+    s.stamp = stamp;
+    s.measured = true;
+    s.zx = x;
+    s.zy = y;
+    s.x.setZero();
+    s.x(0) = x;
+    s.x(1) = y;
+    s.x(2) = vx;
+    s.x(3) = vy;
+    s.P = params->P0;
+    n_steps = 0;
+    push(s);
+  }
+
+  // the current state is kept, its covariance starts over
+  void resetCov()
+  {
+    steps[n_steps - 1].P = params->P0;
+  }
+
+  // stamps at or before the current one leave the filter as it is
+  void predict(double stamp)
+  {
+    Step s = steps[n_steps - 1];
+    if (stamp <= s.stamp) { return; }
+    predictStep(*params, stamp - s.stamp, s.x, s.P);
+    s.stamp = stamp;
+    s.measured = false;
+    push(s);
+  }
+
+  void update(double zx, double zy)
+  {
+    Step& s = steps[n_steps - 1];
+    updateStep(*params, zx, zy, s.x, s.P);
+    s.measured = true;
+    s.zx = zx;
+    s.zy = zy;
+  }
+
+  // prediction for a stamp between the kept steps, false if it is older than all of them
+  bool priorAt(double stamp, LegState& x, LegStateCov& P) const
+  {
+    int k = n_steps - 1;
+    while (k >= 0 && steps[k].stamp > stamp) { k--; }
+    if (k < 0) { return false; }
+    x = steps[k].x;
+    P = steps[k].P;
+    predictStep(*params, stamp - steps[k].stamp, x, P);
+    return true;
+  }
+
+  // out of sequence measurement, false if it is older than all kept steps
+  bool updateLate(double stamp, double zx, double zy)
+  {
+    int k = n_steps - 1;
+    while (k >= 0 && steps[k].stamp > stamp) { k--; }
+    if (k < 0) { return false; }
+
+    Step s = steps[k];
+    predictStep(*params, stamp - s.stamp, s.x, s.P);
+    updateStep(*params, zx, zy, s.x, s.P);
+    s.stamp = stamp;
+    s.measured = true;
+    s.zx = zx;
+    s.zy = zy;
+
+    // the late step goes after step k, the oldest step makes room if needed
+    int first = k + 1;
+    if (n_steps == max_steps)
+    {
+      for (int j = 1; j <= k; j++) { steps[j - 1] = steps[j]; }
+      first = k;
+    }
+    else
+    {
+      for (int j = n_steps; j > first; j--) { steps[j] = steps[j - 1]; }
+      n_steps++;
+    }
+    steps[first] = s;
+
+    // filter the newer steps again
+    for (int j = first + 1; j < n_steps; j++)
+    {
+      LegState x = steps[j - 1].x;
+      LegStateCov P = steps[j - 1].P;
+      predictStep(*params, steps[j].stamp - steps[j - 1].stamp, x, P);
+      if (steps[j].measured) { updateStep(*params, steps[j].zx, steps[j].zy, x, P); }
+      steps[j].x = x;
+      steps[j].P = P;
+    }
+    return true;
+  }
+
+  const LegState& getState() const
+  {
+    return steps[n_steps - 1].x;
+  }
+
+  const LegStateCov& getCov() const
+  {
+    return steps[n_steps - 1].P;
+  }
+
+  double getStamp() const
+  {
+    return steps[n_steps - 1].stamp;
+  }
+
+  // innovation covariance C * P * C^T + R of the current state
+  LegMeasCov getInnovationCov() const
+  {
+    return getCov().topLeftCorner<2, 2>() + params->R;
+  }
+};
+
+#endif
@@ -9,11 +9,19 @@
 #include <cstdlib>
 #include <fstream>
 #include <tuple>
+#include <unordered_map>
+#include <limits>
 
 #include <Eigen/Geometry>
 #include <Eigen/Eigenvalues>
 
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <sensor_msgs/LaserScan.h>
 #include <std_msgs/String.h>
 #include <std_msgs/Float64MultiArray.h>
@@ -43,18 +51,66 @@
 #include <visualization_msgs/Marker.h>
 #include <visualization_msgs/MarkerArray.h>
 
-#include <iirob_filters/kalman_filter.h>
-#include <iirob_filters/KalmanFilterParameters.h>
-
 #include <leg_tracker/munkres.h>
 #include <leg_tracker/leg.h>
+#include <leg_tracker/track_index.h>
+#include <leg_tracker/affinity_table.h>
+#include <leg_tracker/tombstone_store.h>
+#include <leg_tracker/person.h>
+#include <leg_tracker/circle_fitting.h>
+#include <leg_tracker/cluster_classifier.h>
+#include <leg_tracker/background_model.h>
+#include <leg_tracker/polar_gating.h>
+#include <leg_tracker/pair_matching.h>
+#include <leg_tracker/scan_segmenter.h>
+#include <leg_tracker/height_band_scan.h>
+#include <leg_tracker/scan_clock.h>
+#include <leg_tracker/spsc_queue.h>
 #include <leg_tracker/bounding_box.h>
+#include <leg_tracker/zone_grid.h>
 #include <leg_tracker/LegTrackerMessage.h>
 #include <leg_tracker/LegMsg.h>
 #include <leg_tracker/PersonMsg.h>
+#include <leg_tracker/FrameStats.h>
 
 typedef pcl::PointCloud<Point> PointCloud;
 
+// planar pose of a sensor in a fixed frame
+struct SensorPose
+{
+  double x;
+  double y;
+  double yaw;
+  bool valid;
+};
+
+// a scanner of the fused input, projected, filtered and clustered on its own thread
+struct ScanSensor
+{
+  std::string topic;
+  ros::CallbackQueue queue;
+  boost::shared_ptr<ros::AsyncSpinner> spinner;
+  ros::Subscriber sub;
+  laser_geometry::LaserProjection projector;
+  ScanClock clock;
+  // from the scan stamp to the end of its clustering, in seconds
+  double latency;
+  // field of view of the last scan in transform_link, the legs outside it are predicted but not missed
+  SensorPose pose;
+  double angle_min;
+  double angle_max;
+  double range_min;
+  double range_max;
+};
+
+// a scan of the pipeline with its clusters in transform_link, the buffers are reused
+struct ScanFrame
+{
+  sensor_msgs::LaserScan::ConstPtr scan;
+  PointCloud cloud;
+  std::vector<pcl::PointIndices> cluster_indices;
+};
+
 
 class LegDetector
 {
@@ -70,6 +126,7 @@ private:
   ros::Publisher fst_leg_msg_pub;
   ros::Publisher snd_leg_msg_pub;
   ros::Publisher people_msg_pub;
+  ros::Publisher frame_stats_pub;
   
   ros::Publisher marker_pub;
   ros::Publisher cov_marker_pub;
@@ -83,6 +140,12 @@ private:
 
   std::string transform_link;
   std::string scan_topic;
+  // PointCloud2 input instead of scan_topic if set, sliced to a pseudo scan around z_coordinate
+  std::string cloud_topic;
+  double cloud_band_height;
+  double cloud_angle_increment;
+  double cloud_range_min;
+  double cloud_range_max;
   std::string global_map_topic;
   
   double x_lower_limit;
@@ -97,8 +160,32 @@ private:
   
   tf2_ros::Buffer tfBuffer;
   tf2_ros::TransformListener tfListener;
-  double ransac_dist_threshold;
+  // centroid, kasa, taubin or ransac
   std::string circle_fitting;
+  double ransac_dist_threshold;
+  int ransac_max_iterations;
+  // k-means iterations when a cluster is split into several legs
+  int cluster_split_iterations;
+  // drops non-leg clusters, disabled without a model file
+  std::string cluster_classifier_model;
+  ClusterClassifier cluster_classifier;
+  int classified_clusters;
+  int rejected_clusters;
+  double classification_time;
+  // positions of people legs, now and predicted to the scan in process
+  std::vector<Point> leg_positions;
+  std::vector<Point> predicted_leg_positions;
+  // euclidean (kd-tree on the filtered cloud) or scan_order (incremental, in beam order)
+  std::string clustering_mode;
+  double segment_change_threshold;
+  ScanSegmenter<Point> scan_segmenter;
+  SensorPose segmenter_pose;
+  leg_tracker::FrameStats frame_stats;
+  // clustering is degraded step by step when it takes longer than clustering_time_budget
+  double clustering_time_budget;
+  double clustering_far_range;
+  int degradation_level;
+  ros::WallTime clustering_start;
   double leg_radius;
   std::vector<double> centerOfLegLastMeasurement;
   Point person_center;
@@ -109,6 +196,10 @@ private:
   double z_coordinate;
   double vel_stance_threshold;
   double vel_swing_threshold;
+  // skip the kalman filter for legs slower than vel_stance_threshold
+  bool stance_fast_path;
+  // updates in a row below vel_stance_threshold before a leg enters the stance
+  int stance_entry_updates;
   int state_dimensions;
   int minClusterSize;
   int maxClusterSize;
@@ -118,6 +209,7 @@ private:
 
   bool isOnePersonToTrack;
   bool isBoundingBoxTracking;
+  bool optimal_leg_pairing;
 
   unsigned int legs_marker_next_id;
   unsigned int people_marker_next_id;
@@ -137,6 +229,9 @@ private:
   double cluster_bounding_box_uncertainty;
   double outlier_removal_radius;
   int max_neighbors_for_outlier_removal;
+  // target spacing of the points, derived from leg_radius, minClusterSize, the outlier removal and clusterTolerance
+  bool arc_length_decimation;
+  double arc_length_spacing;
   
   double ellipse_x;
   double ellipse_y;
@@ -154,23 +249,114 @@ private:
   bool got_map;
   bool with_map;
   
+  // a sensor pose change beyond these invalidates what was learned for the old pose
+  double sensor_moved_distance;
+  double sensor_moved_angle;
+  
+  // per beam model of the static background, learned while the sensor stands still
+  bool background_subtraction;
+  std::string background_fixed_frame;
+  double background_tolerance;
+  int background_learning_scans;
+  BackgroundModel background_model;
+  SensorPose background_pose;
+  
+  // beams ending on the map where it is expected from ray casting are dropped
+  bool map_ray_casting;
+  double map_range_tolerance;
+  // cells the rays stop at, only lethal ones by default as inflated costmap cells lie in front of the walls
+  int map_occupied_threshold;
+  unsigned int map_version;
+  unsigned int expected_ranges_map_version;
+  std::vector<float> expected_ranges;
+  SensorPose expected_ranges_pose;
+  
+  // scans that differ from the last processed one in at most idle_changed_beams beams are skipped without tracks
+  bool idle_gate;
+  double idle_range_tolerance;
+  int idle_changed_beams;
+  std::vector<float> reference_ranges;
+  bool idle;
+  
+  // only beams near predicted legs and along the border of the tracking area are processed
+  bool attention_mode;
+  int attention_full_scan_every;
+  double attention_entry_band;
+  unsigned int attention_frame;
+  
+  // cost matrix entries are only computed for tracks and clusters with overlapping bearings
+  bool polar_gating;
+  // no measurement farther than this from a track is assigned to it
+  static constexpr double max_assignment_dist = 0.6;
+  
   std::vector<Leg> legs;
-  std::vector<Leg> removed_legs;
+  // dead legs whose partner is still tracked, by people id
+  TombstoneStore lost_legs;
+  TrackIndex track_index;
+  AffinityTable leg_affinity;
   
   std::vector<BoundingBox> tracking_zones;
+  ZoneGrid zone_grid;
   
   bool got_map_from_service;
   
-  // counter, peopleId, last position
-  std::vector<std::tuple<unsigned int, unsigned int, Point> > lastSeenPeoplePositions;
+  // tracked people by people id
+  std::map<int, Person> persons;
+  bool person_gating;
+  double person_gate;
+  double person_process_noise;
+  double person_measurement_noise;
+  
+  // people whose both legs are lost, for re-identification
+  TombstoneStore lost_people;
+  int lost_people_capacity;
+  double lost_people_timeout;
+  double lost_people_timeout_near_limits;
+  
+  // stamp of the scan in process
+  ros::Time current_stamp;
   
   std::map<int, visualization_msgs::Marker> paths;
   
   int checked, how_much_times_to_check;
   
-  std::pair<int, int> left_right;
-  double conf_left_right;
-  std::pair<int, int> ij_or_ji;
+  // shared by the filters of all legs
+  LegFilterParams leg_filter_params;
+  
+  // period and gaps of scan_topic, frequency is only the initial period
+  ScanClock scan_clock;
+  // measured period of the scans of the frame in process
+  double scan_period;
+  ros::Time newest_frame_stamp;
+  
+  // tracking state, taken by the scan callbacks, the fusion and the map callback
+  std::mutex tracking_mutex;
+  
+  // several scanners tracked in one, each scan on arrival at its own stamp, 
+  // scans more than max_scan_delay older than the newest one are dropped
+  std::vector<std::string> scan_topics;
+  double max_scan_delay;
+  ros::Time newest_scan_stamp;
+  // sensor of the scan being tracked, NULL if it sees every leg
+  const ScanSensor* view_sensor;
+  // last member, its worker threads are stopped before anything else is destroyed
+  std::vector<boost::shared_ptr<ScanSensor> > scan_sensors;
+  
+  // scan_topic in two stages: projection, filtering and clustering on one thread,
+  // tracking and publishing on another, handed over through the queues
+  bool pipelined;
+  std::atomic<bool> pipeline_running;
+  // newest scan not yet taken by the clustering stage, guarded by pipeline_mutex
+  sensor_msgs::LaserScan::ConstPtr pending_scan;
+  SpscQueue<ScanFrame, 2> frame_queue;
+  // frame being tracked, swapped out of frame_queue so that the next one can be clustered meanwhile
+  ScanFrame tracked_frame;
+  ScanSensor pipeline_sensor;
+  std::mutex pipeline_mutex;
+  std::condition_variable pipeline_cv;
+  std::thread clustering_thread;
+  std::thread tracking_thread;
+  
   
 
 public:
@@ -178,7 +364,11 @@ public:
   
   LegDetector(ros::NodeHandle nh);
   
-  ~LegDetector() {}
+  ~LegDetector() 
+  {
+    stopPipeline();
+    for (int i = 0; i < scan_sensors.size(); i++) { scan_sensors[i]->spinner->stop(); }
+  }
   
   void init();
   
@@ -195,10 +385,26 @@ public:
   bool tfTransformOfPointCloud2(const sensor_msgs::LaserScan::ConstPtr& scan, 
                                 sensor_msgs::PointCloud2& from, sensor_msgs::PointCloud2& to);
 
+  bool lookupSensorPose(const std::string& fixed_frame, std::string sensor_frame, SensorPose& pose);
+
+  bool sensorMoved(const SensorPose& from, const SensorPose& to);
+
+  void rayCastExpectedRanges(const SensorPose& pose, const sensor_msgs::LaserScan& scan);
+
+  void maskStaticBeams(sensor_msgs::LaserScan& scan);
+
+  bool isSceneIdle(const sensor_msgs::LaserScan& scan);
+
+  void maskBeamsOutsideAttention(sensor_msgs::LaserScan& scan);
+
   void pub_leg_posvelacc(std::vector<double>& in, bool isSnd, std_msgs::Header header);
 
+  void decimateByArcLength(PointCloud& cloud);
+
   bool filterPCLPointCloud(const PointCloud& in, PointCloud& out);
   
+  void loadLegFilterParams();
+
   Leg initLeg(const Point& p);
   
   void printLegsInfo(std::vector<Leg> vec, std::string name);
@@ -228,6 +434,14 @@ public:
   void findPeople();
 
   void findSecondLeg(int fst_leg);
+
+  bool isPairingCandidate(int i);
+
+  void pairLegsByAssignment();
+
+  double historyGain(const Leg& fst, const Leg& snd);
+
+  void updateLegAffinity();
   
   double distanceBtwTwoPoints(double x1, double y1, double x2, double y2);
   
@@ -235,9 +449,9 @@ public:
 
   void setPeopleId(int fst_leg, int snd_leg);
   
-  void eraseRemovedLegsWithoutId();
-  
   void eraseRemovedLeg(int id);
+
+  Tombstone getTombstone(Leg& l, double x, double y, double timeout);
   
   visualization_msgs::Marker getOvalMarker(int id, double x, double y, 
       double orientation_x, double orientation_y, double orientation_z, double orientation_w,
@@ -246,7 +460,9 @@ public:
   visualization_msgs::Marker getOvalMarkerForTwoPoints(int pId, double x1, double y1, 
                                                        double x2, double y2, int id);
 
-  void checkIfLeftOrRight(int i, int j);
+  void checkIfLeftOrRight(int i, int j, GaitState& gait);
+
+  int getLegSide(int peopleId, unsigned int legId);
 
   void vis_people(std_msgs::Header header);
 
@@ -257,7 +473,25 @@ public:
 
   unsigned int getPeopleMarkerNextId();
 
+  Point getClusterCenter(const PointCloud& cloud, const std::vector<int>& indices);
+
+  Point getClusterCenter(const PointCloud& cloud, const std::vector<int>& indices, const ClusterMoments& m);
+
+  bool splitCluster(const PointCloud& cloud, const std::vector<int>& indices, 
+		    std::vector<Point> seeds, PointCloud& cluster_centroids);
+
+  bool extractClusters(const PointCloud& cloud, std::vector<pcl::PointIndices>& cluster_indices);
+
   bool clustering(const PointCloud& cloud, PointCloud& cluster_centroids);
+
+  bool scanOrderClustering(const sensor_msgs::LaserScan& scan, PointCloud& cluster_centroids);
+
+  void collectLegSeeds();
+
+  void addClusterCenters(const PointCloud& cloud, const std::vector<int>& indices, 
+			 const ClusterMoments& m, PointCloud& cluster_centroids);
+
+  void reportClassification();
   
   void pub_bounding_box(double min_x, double min_y, double max_x, double max_y);
   
@@ -265,11 +499,26 @@ public:
 
   void predictLegs();
 
-  void removeLegFromVector(std::vector<Leg>& v, unsigned int i);
+  // predict and update of a leg, timed into frame_stats.filter_time
+  void predictLeg(Leg& l);
+
+  void updateLeg(Leg& l, const Point& p);
+
+  bool isLegInView(Leg& l);
+
+  void missLeg(Leg& l);
+
+  void setSensorView(ScanSensor& sensor, const sensor_msgs::LaserScan& scan);
+
+  void removeLeg(unsigned int i);
   
-  void resetHasPair(std::vector<Leg>& v, int fst_leg);
+  void resetHasPair(int fst_leg);
+
+  void cullDeadTracks();
 
-  void cullDeadTracks(std::vector<Leg>& v);
+  void reindexLegs();
+
+  void setLegPeopleId(int i, int id);
 
   unsigned int getNextCovEllipseId();
   
@@ -279,6 +528,18 @@ public:
                                   PointCloud& cluster_centroids, int tracking_zone_index);
 
   void gnn_munkres(PointCloud& cluster_centroids);
+
+  double assignmentCost(Leg& l, const Point& p);
+
+  void predictPersons();
+
+  void updatePersons();
+
+  double gatedLegCost(Leg& l, const Point& p);
+
+  void personGating(const PointCloud& cluster_centroids, PointCloud& rest_points, std::vector<bool>& handled);
+
+  void assignClustersToPersonLegs(int fst_leg, int snd_leg, const PointCloud& clusters, PointCloud& rest_points);
     
   void assign_munkres(const PointCloud& meas, std::vector<Leg> &tracks, std::vector<Leg> &fused);
     
@@ -294,8 +555,6 @@ public:
     
   void deleteOldMarkers();
     
-  void removeLastSeenPeoplePosition(int i);
-  
   bool isPointNearToLimits(Point p);
   
   void updateLastSeenPeoplePositions();
@@ -306,11 +565,52 @@ public:
   
   void resetLeftRight();
 
+  void processPointCloud(const sensor_msgs::PointCloud2::ConstPtr& cloud);
+
+  void setScanStats(const ScanClock& clock);
+
+  bool beginFrame(const ros::Time& stamp);
+
   void processLaserScan(const sensor_msgs::LaserScan::ConstPtr& scan);
+
+  void startScanSensors();
+
+  void processSensorScan(const sensor_msgs::LaserScan::ConstPtr& scan, int index);
+
+  void extractSensorClusters(const sensor_msgs::LaserScan::ConstPtr& scan, laser_geometry::LaserProjection& projector, 
+			     PointCloud& cloud, std::vector<pcl::PointIndices>& cluster_indices);
+
+  void startPipeline();
+
+  void stopPipeline();
+
+  void notifyPipeline();
+
+  void queueLaserScan(const sensor_msgs::LaserScan::ConstPtr& scan);
+
+  void runClusteringStage();
+
+  void runTrackingStage();
+
+  void trackSensorScan(const ScanSensor& sensor, const ros::Time& stamp, 
+		       const PointCloud& cloud, const std::vector<pcl::PointIndices>& cluster_indices);
+
+  void trackClusterCentroids(const std_msgs::Header& header, PointCloud& cluster_centroids);
+
+  void publishFrameStats(const std_msgs::Header& header);
+
+  sensor_msgs::LaserScan::Ptr degradeScan(const sensor_msgs::LaserScan& scan);
+
+  bool isClusteringOverBudget();
+
+  void updateDegradationLevel();
   
-  void publish_person_msg_stamped(int fst_leg_index, int snd_leg_index, std_msgs::Header header);
+  void publish_person_msg_stamped(int peopleId, const leg_tracker::LegMsg& leg1, 
+				  const leg_tracker::LegMsg& leg2, std_msgs::Header header);
   
-  leg_tracker::LegMsg getLegMsg(int leg_index);
+  leg_tracker::LegMsg getLegMsg(Leg& leg);
+
+  leg_tracker::LegMsg getLegMsg(const Tombstone& removed_leg);
 };
 
 #endif
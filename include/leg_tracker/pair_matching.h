@@ -0,0 +1,103 @@
+#ifndef LEG_TRACKER_PAIR_MATCHING_H
+#define LEG_TRACKER_PAIR_MATCHING_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// Maximum weight matching of a general graph given by its symmetric weight
+// matrix, a negative weight is a missing edge. Every connected component is
+// solved exactly by dynamic programming over the subsets of its vertices,
+// components with more than max_exact vertices are matched greedily by
+// weight. mate[i] is the vertex matched to i or -1. Returns false if a
+// component was matched greedily.
+inline bool maxWeightMatching(const std::vector<std::vector<double> >& weight, std::vector<int>& mate,
+  int max_exact = 16)
+{
+  int n = weight.size();
+  mate.assign(n, -1);
+  bool exact = true;
+  std::vector<int> component(n, -1);
+  for (int root = 0; root < n; root++)
+  {
+    if (component[root] != -1) { continue; }
+    // vertices of the component of root
+    std::vector<int> vertices(1, root);
+    component[root] = root;
+    for (int k = 0; k < vertices.size(); k++)
+    {
+      for (int j = 0; j < n; j++)
+      {
+	if (component[j] == -1 && weight[vertices[k]][j] >= 0.)
+	{
+	  component[j] = root;
+	  vertices.push_back(j);
+	}
+      }
+    }
+    int m = vertices.size();
+    if (m < 2) { continue; }
+
+    if (m > max_exact)
+    {
+      exact = false;
+      std::vector<std::pair<double, std::pair<int, int> > > edges;
+      for (int a = 0; a < m; a++)
+      {
+	for (int b = a + 1; b < m; b++)
+	{
+	  double w = weight[vertices[a]][vertices[b]];
+	  if (w >= 0.) { edges.push_back(std::make_pair(-w, std::make_pair(vertices[a], vertices[b]))); }
+	}
+      }
+      std::sort(edges.begin(), edges.end());
+      for (int k = 0; k < edges.size(); k++)
+      {
+	int a = edges[k].second.first, b = edges[k].second.second;
+	if (mate[a] != -1 || mate[b] != -1) { continue; }
+	mate[a] = b;
+	mate[b] = a;
+      }
+      continue;
+    }
+
+    // best[mask]: weight of the best matching within mask, the lowest vertex of mask
+    // is either left alone (choice -1) or matched to the vertex choice[mask]
+    int subsets = 1 << m;
+    std::vector<double> best(subsets, 0.);
+    std::vector<signed char> choice(subsets, -1);
+    for (int mask = 1; mask < subsets; mask++)
+    {
+      int a = 0;
+      while (!(mask & (1 << a))) { a++; }
+      int rest = mask & ~(1 << a);
+      best[mask] = best[rest];
+      for (int b = a + 1; b < m; b++)
+      {
+	if (!(rest & (1 << b))) { continue; }
+	double w = weight[vertices[a]][vertices[b]];
+	if (w < 0.) { continue; }
+	double total = w + best[rest & ~(1 << b)];
+	if (total > best[mask])
+	{
+	  best[mask] = total;
+	  choice[mask] = b;
+	}
+      }
+    }
+    for (int mask = subsets - 1; mask != 0;)
+    {
+      int a = 0;
+      while (!(mask & (1 << a))) { a++; }
+      mask &= ~(1 << a);
+      int b = choice[mask | (1 << a)];
+      if (b == -1) { continue; }
+      mask &= ~(1 << b);
+      mate[vertices[a]] = vertices[b];
+      mate[vertices[b]] = vertices[a];
+    }
+  }
+  return exact;
+}
+
+#endif
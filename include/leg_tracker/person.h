@@ -0,0 +1,192 @@
+#ifndef LEG_TRACKER_PERSON_H
+#define LEG_TRACKER_PERSON_H
+
+#include <cmath>
+#include <utility>
+#include <Eigen/Core>
+#include <leg_tracker/track_index.h>
+
+typedef Eigen::Matrix<double, 4, 1, Eigen::DontAlign> PersonState;
+typedef Eigen::Matrix<double, 4, 4, Eigen::DontAlign> PersonCov;
+
+// Left/right labelling of the two legs of a person. ij_or_ji counts how often
+// the leg with the smaller index was seen on the left (first) or on the
+// right (second) side.
+struct GaitState
+{
+  std::pair<int, int> left_right;
+  std::pair<int, int> ij_or_ji;
+  double conf_left_right;
+
+  GaitState()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    left_right = std::make_pair(-1, -1);
+    ij_or_ji = std::make_pair(0, 0);
+    conf_left_right = 0.01;
+  }
+};
+
+// Track of a person on top of its two legs. A constant velocity filter on
+// the centroid of the legs, state (x, y, vx, vy), with the heading taken
+// from the velocity while the person walks.
+class Person
+{
+
+private:
+  int peopleId;
+  TrackHandle fst_leg;
+  TrackHandle snd_leg;
+  PersonState x;
+  PersonCov P;
+  double heading;
+  GaitState gait;
+  double last_stamp;
+  double process_noise;
+  double measurement_noise;
+
+public:
+  Person() = delete;
+
+  Person(int peopleId, const TrackHandle& fst_leg, const TrackHandle& snd_leg,
+    double pos_x, double pos_y, double stamp, double process_noise = 1.0, double measurement_noise = 0.01)
+  {
+    this->peopleId = peopleId;
+    this->fst_leg = fst_leg;
+    this->snd_leg = snd_leg;
+    this->process_noise = process_noise;
+    this->measurement_noise = measurement_noise;
+    last_stamp = stamp;
+    heading = 0.;
+    x << pos_x, pos_y, 0., 0.;
+    P.setZero();
+    P(0, 0) = P(1, 1) = measurement_noise;
+    P(2, 2) = P(3, 3) = 1.0;
+  }
+
+  void predict(double stamp)
+  {
+    double dt = stamp - last_stamp;
+    if (dt <= 0.) { return; }
+    last_stamp = stamp;
+
+    x(0) += dt * x(2);
+    x(1) += dt * x(3);
+
+    // P = F * P * F^T + Q with the white noise acceleration model
+    PersonCov F = PersonCov::Identity();
+    F(0, 2) = F(1, 3) = dt;
+    P = F * P * F.transpose();
+    double q = process_noise;
+    double dt2 = dt * dt;
+    P(0, 0) += q * dt2 * dt / 3.; P(1, 1) += q * dt2 * dt / 3.;
+    P(0, 2) += q * dt2 / 2.;      P(2, 0) += q * dt2 / 2.;
+    P(1, 3) += q * dt2 / 2.;      P(3, 1) += q * dt2 / 2.;
+    P(2, 2) += q * dt;            P(3, 3) += q * dt;
+  }
+
+  void update(double meas_x, double meas_y)
+  {
+    double s00 = P(0, 0) + measurement_noise;
+    double s01 = P(0, 1);
+    double s11 = P(1, 1) + measurement_noise;
+    double det = s00 * s11 - s01 * s01;
+    if (det <= 1e-12) { return; }
+    double i00 = s11 / det, i01 = -s01 / det, i11 = s00 / det;
+
+    // K = P * H^T * S^-1, H selects the position
+    Eigen::Matrix<double, 4, 2, Eigen::DontAlign> K;
+    for (int r = 0; r < 4; r++)
+    {
+      K(r, 0) = P(r, 0) * i00 + P(r, 1) * i01;
+      K(r, 1) = P(r, 0) * i01 + P(r, 1) * i11;
+    }
+    double dx = meas_x - x(0);
+    double dy = meas_y - x(1);
+    x += K.col(0) * dx + K.col(1) * dy;
+    PersonCov KH = PersonCov::Zero();
+    KH.leftCols(2) = K;
+    P = (PersonCov::Identity() - KH) * P;
+
+    if (std::sqrt(x(2) * x(2) + x(3) * x(3)) > 0.1)
+    {
+      heading = std::atan2(x(3), x(2));
+    }
+  }
+
+  // squared mahalanobis distance of a leg cluster to the centroid, the legs are
+  // spread around the centroid with the variance leg_spread_var
+  double gateDistanceSquared(double px, double py, double leg_spread_var) const
+  {
+    double s00 = P(0, 0) + measurement_noise + leg_spread_var;
+    double s01 = P(0, 1);
+    double s11 = P(1, 1) + measurement_noise + leg_spread_var;
+    double det = s00 * s11 - s01 * s01;
+    if (det <= 1e-12) { return -1.; }
+    double dx = px - x(0);
+    double dy = py - x(1);
+    return (s11 * dx * dx - 2. * s01 * dx * dy + s00 * dy * dy) / det;
+  }
+
+  int getPeopleId() const
+  {
+    return peopleId;
+  }
+
+  const TrackHandle& getFstLeg() const
+  {
+    return fst_leg;
+  }
+
+  const TrackHandle& getSndLeg() const
+  {
+    return snd_leg;
+  }
+
+  void setLegs(const TrackHandle& fst, const TrackHandle& snd)
+  {
+    fst_leg = fst;
+    snd_leg = snd;
+  }
+
+  double getX() const
+  {
+    return x(0);
+  }
+
+  double getY() const
+  {
+    return x(1);
+  }
+
+  double getVelX() const
+  {
+    return x(2);
+  }
+
+  double getVelY() const
+  {
+    return x(3);
+  }
+
+  double getHeading() const
+  {
+    return heading;
+  }
+
+  GaitState& getGait()
+  {
+    return gait;
+  }
+
+  const GaitState& getGait() const
+  {
+    return gait;
+  }
+};
+
+#endif
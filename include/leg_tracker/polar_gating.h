@@ -0,0 +1,126 @@
+#ifndef LEG_TRACKER_POLAR_GATING_H
+#define LEG_TRACKER_POLAR_GATING_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+
+struct BearingInterval
+{
+  double start;
+  double end;
+  int index;
+
+  bool operator<(const BearingInterval& other) const
+  {
+    return start < other.start;
+  }
+};
+
+// Interval of bearings seen from the origin that holds every point within
+// radius of (x, y). Intervals crossing +-pi are split in two.
+inline void addBearingInterval(double x, double y, double radius, int index, std::vector<BearingInterval>& intervals)
+{
+  BearingInterval interval;
+  interval.index = index;
+  double range = std::sqrt(x * x + y * y);
+  if (range <= radius)
+  {
+    interval.start = -M_PI;
+    interval.end = M_PI;
+    intervals.push_back(interval);
+    return;
+  }
+  double bearing = std::atan2(y, x);
+  double half_width = std::asin(radius / range);
+  interval.start = bearing - half_width;
+  interval.end = bearing + half_width;
+  if (interval.start < -M_PI)
+  {
+    BearingInterval wrapped = interval;
+    wrapped.start += 2. * M_PI;
+    wrapped.end = M_PI;
+    intervals.push_back(wrapped);
+    interval.start = -M_PI;
+  }
+  else if (interval.end > M_PI)
+  {
+    BearingInterval wrapped = interval;
+    wrapped.start = -M_PI;
+    wrapped.end -= 2. * M_PI;
+    intervals.push_back(wrapped);
+    interval.end = M_PI;
+  }
+  intervals.push_back(interval);
+}
+
+// Sweep over the intervals and the bearings of the points, both sorted by
+// bearing. Every (point, interval) pair with the bearing inside the interval
+// is returned as (point index, interval index).
+inline void sweepBearingIntervals(std::vector<BearingInterval> intervals, std::vector<std::pair<double, int> > bearings,
+  std::vector<std::pair<int, int> >& pairs)
+{
+  std::sort(intervals.begin(), intervals.end());
+  std::sort(bearings.begin(), bearings.end());
+  std::vector<const BearingInterval*> active;
+  int next = 0;
+  for (int k = 0; k < bearings.size(); k++)
+  {
+    double bearing = bearings[k].first;
+    while (next < intervals.size() && intervals[next].start <= bearing)
+    {
+      active.push_back(&intervals[next]);
+      next++;
+    }
+    int kept = 0;
+    for (int a = 0; a < active.size(); a++)
+    {
+      if (active[a]->end < bearing) { continue; }
+      active[kept++] = active[a];
+      pairs.push_back(std::make_pair(bearings[k].second, active[a]->index));
+    }
+    active.resize(kept);
+  }
+}
+
+// Connected components of the bipartite graph of (point, interval index)
+// pairs, one assignment problem each. Points and intervals without a pair
+// get component -1. Returns the number of components.
+inline int pairComponents(int points, int indices, const std::vector<std::pair<int, int> >& pairs,
+  std::vector<int>& point_component, std::vector<int>& index_component)
+{
+  // union find over the points followed by the interval indices
+  std::vector<int> parent(points + indices);
+  for (int i = 0; i < parent.size(); i++) { parent[i] = i; }
+  struct Find
+  {
+    static int root(std::vector<int>& parent, int i)
+    {
+      while (parent[i] != i) { i = parent[i] = parent[parent[i]]; }
+      return i;
+    }
+  };
+  for (int k = 0; k < pairs.size(); k++)
+  {
+    int a = Find::root(parent, pairs[k].first), b = Find::root(parent, points + pairs[k].second);
+    if (a != b) { parent[a] = b; }
+  }
+  std::vector<int> component(parent.size(), -1);
+  std::vector<char> paired(parent.size(), 0);
+  for (int k = 0; k < pairs.size(); k++) { paired[pairs[k].first] = paired[points + pairs[k].second] = 1; }
+  int count = 0;
+  point_component.assign(points, -1);
+  index_component.assign(indices, -1);
+  for (int i = 0; i < parent.size(); i++)
+  {
+    if (!paired[i]) { continue; }
+    int root = Find::root(parent, i);
+    if (component[root] == -1) { component[root] = count++; }
+    if (i < points) { point_component[i] = component[root]; }
+    else { index_component[i - points] = component[root]; }
+  }
+  return count;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef LEG_TRACKER_RING_BUFFER_H
+#define LEG_TRACKER_RING_BUFFER_H
+
+#include <algorithm>
+
+// Fixed-size ring buffer stored inline, the newest element has age 0.
+template <typename T, int N>
+class RingBuffer
+{
+
+private:
+  T data[N];
+  int head;
+  int count;
+  int cap;
+
+public:
+  RingBuffer(int capacity = N) : head(0), count(0)
+  {
+    cap = std::max(1, std::min(capacity, N));
+  }
+
+  void push(const T& value)
+  {
+    head = (head + 1) % cap;
+    data[head] = value;
+    if (count < cap) { count++; }
+  }
+
+  // element pushed age pushes ago
+  const T& operator[](int age) const
+  {
+    return data[(head - age + cap) % cap];
+  }
+
+  T& operator[](int age)
+  {
+    return data[(head - age + cap) % cap];
+  }
+
+  void pop()
+  {
+    if (count == 0) { return; }
+    head = (head - 1 + cap) % cap;
+    count--;
+  }
+
+  void clear()
+  {
+    head = count = 0;
+  }
+
+  int size() const
+  {
+    return count;
+  }
+
+  int capacity() const
+  {
+    return cap;
+  }
+
+  bool full() const
+  {
+    return count == cap;
+  }
+};
+
+#endif
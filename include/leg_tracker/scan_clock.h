@@ -0,0 +1,103 @@
+#ifndef LEG_TRACKER_SCAN_CLOCK_H
+#define LEG_TRACKER_SCAN_CLOCK_H
+
+#include <cmath>
+#include <algorithm>
+#include <leg_tracker/ring_buffer.h>
+
+// Period of a scan topic from the stamps of its scans. The period is the
+// median of the recent gaps, so that it follows a scanner that is throttled
+// or runs at another rate than configured, while a gap with a few dropped
+// scans does not stretch it. A gap of several periods counts the scans
+// dropped on the way, a stamp that is not newer than the last one counts
+// as late.
+class ScanClock
+{
+
+public:
+  // gaps the median is taken over
+  static const int window = 15;
+  static const int min_gaps = 3;
+
+private:
+  // configured period, used until the first gaps are seen
+  double nominal_period;
+  double period;
+  RingBuffer<double, window> gaps;
+  double last;
+  bool started;
+  unsigned int dropped;
+  unsigned int late;
+
+  // median of the recent gaps, the configured period while there are fewer than min_gaps
+  void updatePeriod()
+  {
+    if (gaps.size() < min_gaps)
+    {
+      period = nominal_period;
+      return;
+    }
+    double sorted[window];
+    int n = gaps.size();
+    for (int k = 0; k < n; k++) { sorted[k] = gaps[k]; }
+    std::nth_element(sorted, sorted + n / 2, sorted + n);
+    period = sorted[n / 2];
+  }
+
+public:
+  ScanClock(double period = 0.05)
+  {
+    reset(period);
+  }
+
+  void reset(double period)
+  {
+    nominal_period = this->period = period;
+    gaps.clear();
+    last = 0.;
+    started = false;
+    dropped = late = 0;
+  }
+
+  // seconds since the previous scan, 0 for the first and for late ones
+  double tick(double stamp)
+  {
+    if (!started)
+    {
+      started = true;
+      last = stamp;
+      return 0.;
+    }
+    double dt = stamp - last;
+    if (dt <= 0.)
+    {
+      late++;
+      return 0.;
+    }
+    last = stamp;
+    gaps.push(dt);
+    updatePeriod();
+    // drops are counted against the estimate, not against the configured period
+    if (gaps.size() < min_gaps) { return dt; }
+    int missing = int(std::floor(dt / period + 0.5)) - 1;
+    if (missing > 0) { dropped += missing; }
+    return dt;
+  }
+
+  double getPeriod() const
+  {
+    return period;
+  }
+
+  unsigned int getDropped() const
+  {
+    return dropped;
+  }
+
+  unsigned int getLate() const
+  {
+    return late;
+  }
+};
+
+#endif
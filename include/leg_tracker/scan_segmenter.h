@@ -0,0 +1,192 @@
+#ifndef LEG_TRACKER_SCAN_SEGMENTER_H
+#define LEG_TRACKER_SCAN_SEGMENTER_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <pcl/point_cloud.h>
+#include <leg_tracker/circle_fitting.h>
+
+// Segmentation of a laser scan in beam order with temporal coherence.
+// Neighbouring beams belong to the same segment while their end points are
+// closer than the jump distance. Only beams whose range changed by more than
+// the change threshold since they were last processed are projected again,
+// the breaks next to them are re-validated and segments made of unchanged
+// beams keep their moments from the previous scan.
+template <typename PointT>
+class ScanSegmenter
+{
+
+public:
+  struct Segment
+  {
+    // first and last beam of the segment
+    int start;
+    int end;
+    ClusterMoments moments;
+  };
+
+private:
+  double jump_distance;
+  double change_threshold;
+  int min_size;
+  int max_size;
+
+  // ranges the end points were computed from, NaN for invalid beams
+  std::vector<float> reference;
+  // end points of all beams in the target frame, indexed by beam
+  pcl::PointCloud<PointT> points;
+  // break[i]: beams i and i + 1 are in different segments
+  std::vector<char> breaks;
+  std::vector<char> changed;
+  std::vector<Segment> segments;
+  // segment index by its first beam, -1 if no segment starts there
+  std::vector<int> segment_at_start;
+  double reprocessed_fraction;
+
+  bool isValid(int i) const
+  {
+    return std::isfinite(reference[i]);
+  }
+
+public:
+  ScanSegmenter(double jump_distance = 0.07, double change_threshold = 0.02, int min_size = 3, int max_size = 100)
+  {
+    configure(jump_distance, change_threshold, min_size, max_size);
+  }
+
+  void configure(double jump_distance, double change_threshold, int min_size, int max_size)
+  {
+    this->jump_distance = jump_distance;
+    this->change_threshold = change_threshold;
+    this->min_size = min_size;
+    this->max_size = max_size;
+    reset();
+  }
+
+  // forget the previous scan, e.g. when the sensor has moved in the target frame
+  void reset()
+  {
+    reference.clear();
+    points.points.clear();
+    breaks.clear();
+    segments.clear();
+    segment_at_start.clear();
+    reprocessed_fraction = 1.;
+  }
+
+  // sensor_x, sensor_y and sensor_yaw give the pose of the scanner in the target frame
+  void segment(const std::vector<float>& ranges, double angle_min, double angle_increment,
+    double range_min, double range_max, double sensor_x, double sensor_y, double sensor_yaw)
+  {
+    int n = ranges.size();
+    bool full = reference.size() != n;
+    if (full)
+    {
+      reference.assign(n, std::numeric_limits<float>::quiet_NaN());
+      PointT p;
+      p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+      points.points.assign(n, p);
+      breaks.assign(n, 1);
+      segment_at_start.assign(n, -1);
+      segments.clear();
+    }
+    changed.assign(n, 0);
+
+    int reprocessed = 0;
+    for (int i = 0; i < n; i++)
+    {
+      float r = ranges[i];
+      bool valid = r >= range_min && r <= range_max;
+      if (!full && valid == isValid(i) && (!valid || std::fabs(r - reference[i]) <= change_threshold)) { continue; }
+      changed[i] = 1;
+      reprocessed++;
+      if (valid)
+      {
+	double angle = sensor_yaw + angle_min + i * angle_increment;
+	reference[i] = r;
+	points.points[i].x = sensor_x + r * std::cos(angle);
+	points.points[i].y = sensor_y + r * std::sin(angle);
+	points.points[i].z = 0.;
+      }
+      else
+      {
+	reference[i] = std::numeric_limits<float>::quiet_NaN();
+	points.points[i].x = points.points[i].y = points.points[i].z = std::numeric_limits<float>::quiet_NaN();
+      }
+    }
+
+    // re-validate the breaks next to changed beams
+    for (int i = 0; i + 1 < n; i++)
+    {
+      if (!changed[i] && !changed[i + 1]) { continue; }
+      if (!isValid(i) || !isValid(i + 1)) { breaks[i] = 1; continue; }
+      double dist = std::sqrt(std::pow(points.points[i].x - points.points[i + 1].x, 2)
+	+ std::pow(points.points[i].y - points.points[i + 1].y, 2));
+      breaks[i] = dist > jump_distance;
+    }
+    if (n != 0) { breaks[n - 1] = 1; }
+
+    std::vector<Segment> new_segments;
+    std::vector<int> indices;
+    int start = 0;
+    for (int i = 0; i < n; i++)
+    {
+      if (!breaks[i]) { continue; }
+      int end = i;
+      if (isValid(start))
+      {
+	Segment s;
+	s.start = start;
+	s.end = end;
+	int cached = segment_at_start[start];
+	bool unchanged = cached != -1 && segments[cached].end == end;
+	for (int k = start; k <= end && unchanged; k++) { unchanged = !changed[k]; }
+	if (unchanged)
+	{
+	  s.moments = segments[cached].moments;
+	}
+	else
+	{
+	  indices.clear();
+	  for (int k = start; k <= end; k++) { indices.push_back(k); }
+	  computeClusterMoments(points, indices, s.moments);
+	  for (int k = start; k <= end; k++) { reprocessed += !changed[k]; }
+	}
+	new_segments.push_back(s);
+      }
+      start = i + 1;
+    }
+
+    for (int k = 0; k < segments.size(); k++) { segment_at_start[segments[k].start] = -1; }
+    segments.swap(new_segments);
+    for (int k = 0; k < segments.size(); k++) { segment_at_start[segments[k].start] = k; }
+    reprocessed_fraction = n != 0 ? std::min(1., double(reprocessed) / n) : 0.;
+  }
+
+  // all segments, including those outside [min_size, max_size]
+  const std::vector<Segment>& getSegments() const
+  {
+    return segments;
+  }
+
+  bool hasValidSize(const Segment& s) const
+  {
+    int size = s.end - s.start + 1;
+    return size >= min_size && size <= max_size;
+  }
+
+  // end points by beam index, NaN for invalid beams
+  const pcl::PointCloud<PointT>& getPoints() const
+  {
+    return points;
+  }
+
+  // fraction of the beams projected or summed up again in the last scan
+  double getReprocessedFraction() const
+  {
+    return reprocessed_fraction;
+  }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef LEG_TRACKER_SPSC_QUEUE_H
+#define LEG_TRACKER_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free queue for one producer and one consumer thread. The N
+// slots are allocated once and filled in place, so that buffers inside them
+// keep their capacity from frame to frame. One slot is kept free to tell a
+// full queue from an empty one.
+template <typename T, int N>
+class SpscQueue
+{
+
+private:
+  T slots[N];
+  // next slot to read, written by the consumer only
+  std::atomic<size_t> head;
+  // next slot to write, written by the producer only
+  std::atomic<size_t> tail;
+
+  static size_t next(size_t i)
+  {
+    return (i + 1) % N;
+  }
+
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  // producer: slot to fill, NULL while the queue is full
+  T* beginPush()
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (next(t) == head.load(std::memory_order_acquire)) { return NULL; }
+    return &slots[t];
+  }
+
+  // producer: publishes the slot of beginPush
+  void commitPush()
+  {
+    tail.store(next(tail.load(std::memory_order_relaxed)), std::memory_order_release);
+  }
+
+  // consumer: oldest slot, NULL while the queue is empty
+  T* front()
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) { return NULL; }
+    return &slots[h];
+  }
+
+  // consumer: hands the slot of front back to the producer
+  void pop()
+  {
+    head.store(next(head.load(std::memory_order_relaxed)), std::memory_order_release);
+  }
+
+  bool empty() const
+  {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef LEG_TRACKER_TOMBSTONE_STORE_H
+#define LEG_TRACKER_TOMBSTONE_STORE_H
+
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+struct Tombstone
+{
+  int peopleId;
+  unsigned int legId;
+  double x;
+  double y;
+  double vel_x;
+  double vel_y;
+  double stamp;
+  double expires;
+};
+
+// Bounded store of lost people (or legs) keyed by people id. Entries are
+// hashed into a uniform grid for radius lookups and evicted by their expiry
+// time or, when the store is full, oldest expiry first.
+class TombstoneStore
+{
+
+private:
+  int capacity;
+  double cell_size;
+  std::vector<Tombstone> entries;
+  std::vector<bool> used;
+  std::vector<int> free_entries;
+  std::unordered_map<int, int> by_id;
+  std::unordered_map<int64_t, std::vector<int> > grid;
+
+  int64_t cellKey(int cx, int cy) const
+  {
+    return (int64_t(cx) << 32) ^ int64_t(uint32_t(cy));
+  }
+
+  int64_t cellKeyOf(double x, double y) const
+  {
+    return cellKey(int(std::floor(x / cell_size)), int(std::floor(y / cell_size)));
+  }
+
+  void removeEntry(int e)
+  {
+    std::vector<int>& cell = grid[cellKeyOf(entries[e].x, entries[e].y)];
+    for (int k = 0; k < cell.size(); k++)
+    {
+      if (cell[k] == e)
+      {
+	cell[k] = cell.back();
+	cell.pop_back();
+	break;
+      }
+    }
+    if (cell.empty()) { grid.erase(cellKeyOf(entries[e].x, entries[e].y)); }
+    by_id.erase(entries[e].peopleId);
+    used[e] = false;
+    free_entries.push_back(e);
+  }
+
+public:
+  TombstoneStore(int capacity = 64, double cell_size = 1.0)
+  {
+    configure(capacity, cell_size);
+  }
+
+  void configure(int capacity, double cell_size)
+  {
+    this->capacity = std::max(1, capacity);
+    this->cell_size = cell_size > 0. ? cell_size : 1.0;
+    entries.assign(this->capacity, Tombstone());
+    used.assign(this->capacity, false);
+    free_entries.clear();
+    for (int e = this->capacity - 1; e >= 0; e--) { free_entries.push_back(e); }
+    by_id.clear();
+    grid.clear();
+  }
+
+  void insert(const Tombstone& t)
+  {
+    erase(t.peopleId);
+    if (free_entries.empty())
+    {
+      int oldest = 0;
+      for (int e = 1; e < capacity; e++)
+      {
+	if (entries[e].expires < entries[oldest].expires) { oldest = e; }
+      }
+      removeEntry(oldest);
+    }
+    int e = free_entries.back();
+    free_entries.pop_back();
+    entries[e] = t;
+    used[e] = true;
+    by_id[t.peopleId] = e;
+    grid[cellKeyOf(t.x, t.y)].push_back(e);
+  }
+
+  bool erase(int peopleId)
+  {
+    std::unordered_map<int, int>::iterator it = by_id.find(peopleId);
+    if (it == by_id.end()) { return false; }
+    removeEntry(it->second);
+    return true;
+  }
+
+  const Tombstone* find(int peopleId) const
+  {
+    std::unordered_map<int, int>::const_iterator it = by_id.find(peopleId);
+    if (it == by_id.end()) { return NULL; }
+    return &entries[it->second];
+  }
+
+  // nearest entry within radius of (x, y), radius must not exceed the cell size
+  const Tombstone* findNearest(double x, double y, double radius) const
+  {
+    int cx = int(std::floor(x / cell_size));
+    int cy = int(std::floor(y / cell_size));
+    const Tombstone* nearest = NULL;
+    double min_dist = radius;
+    for (int i = cx - 1; i <= cx + 1; i++)
+    {
+      for (int j = cy - 1; j <= cy + 1; j++)
+      {
+	std::unordered_map<int64_t, std::vector<int> >::const_iterator it = grid.find(cellKey(i, j));
+	if (it == grid.end()) { continue; }
+	for (int k = 0; k < it->second.size(); k++)
+	{
+	  const Tombstone& t = entries[it->second[k]];
+	  double dist = std::sqrt(std::pow(t.x - x, 2) + std::pow(t.y - y, 2));
+	  if (dist <= min_dist)
+	  {
+	    min_dist = dist;
+	    nearest = &t;
+	  }
+	}
+      }
+    }
+    return nearest;
+  }
+
+  void evict(double now, std::vector<int>& evicted_ids)
+  {
+    for (int e = 0; e < capacity; e++)
+    {
+      if (used[e] && entries[e].expires <= now)
+      {
+	evicted_ids.push_back(entries[e].peopleId);
+	removeEntry(e);
+      }
+    }
+  }
+
+  int size() const
+  {
+    return by_id.size();
+  }
+};
+
+#endif
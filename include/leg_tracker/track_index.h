@@ -0,0 +1,184 @@
+#ifndef LEG_TRACKER_TRACK_INDEX_H
+#define LEG_TRACKER_TRACK_INDEX_H
+
+#include <vector>
+#include <unordered_map>
+#include <utility>
+
+struct TrackHandle
+{
+  int slot;
+  unsigned int generation;
+
+  TrackHandle() : slot(-1), generation(0) {}
+};
+
+// Generational slot map from leg ids and people ids to the position of the
+// leg in the tracks vector. Slots are taken on birth and released on death,
+// a handle of a dead leg stays invalid even if its slot is reused.
+class TrackIndex
+{
+
+private:
+  struct Slot
+  {
+    unsigned int generation;
+    bool alive;
+    unsigned int legId;
+    int peopleId;
+    int index;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<int> free_slots;
+  std::unordered_map<unsigned int, int> leg_slots;
+  // people id -> slots of its two legs, -1 if not set
+  std::unordered_map<int, std::pair<int, int> > people_slots;
+
+  void removeFromPeople(int slot)
+  {
+    int peopleId = slots[slot].peopleId;
+    if (peopleId == -1) { return; }
+    slots[slot].peopleId = -1;
+    std::unordered_map<int, std::pair<int, int> >::iterator it = people_slots.find(peopleId);
+    if (it == people_slots.end()) { return; }
+    if (it->second.first == slot) { it->second.first = -1; }
+    if (it->second.second == slot) { it->second.second = -1; }
+    if (it->second.first == -1 && it->second.second == -1) { people_slots.erase(it); }
+  }
+
+  // index of the leg that lost its people id to make room, -1 if there is none
+  int addToPeople(int slot, int peopleId)
+  {
+    slots[slot].peopleId = peopleId;
+    std::pair<int, int>& pair = people_slots.insert(std::make_pair(peopleId, std::make_pair(-1, -1))).first->second;
+    if (pair.first == slot || pair.second == slot) { return -1; }
+    if (pair.first == -1) { pair.first = slot; return -1; }
+    int evicted = -1;
+    if (pair.second != -1)
+    {
+      // a person has only two legs, the older second leg loses its link
+      slots[pair.second].peopleId = -1;
+      evicted = slots[pair.second].index;
+    }
+    pair.second = slot;
+    return evicted;
+  }
+
+public:
+  TrackHandle insert(unsigned int legId, int index = -1)
+  {
+    int slot;
+    if (!free_slots.empty())
+    {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    else
+    {
+      slot = slots.size();
+      Slot s;
+      s.generation = 0;
+      slots.push_back(s);
+    }
+    slots[slot].alive = true;
+    slots[slot].legId = legId;
+    slots[slot].peopleId = -1;
+    slots[slot].index = index;
+    leg_slots[legId] = slot;
+
+    TrackHandle h;
+    h.slot = slot;
+    h.generation = slots[slot].generation;
+    return h;
+  }
+
+  bool isValid(const TrackHandle& h) const
+  {
+    return h.slot >= 0 && h.slot < slots.size() && slots[h.slot].alive
+      && slots[h.slot].generation == h.generation;
+  }
+
+  void erase(const TrackHandle& h)
+  {
+    if (!isValid(h)) { return; }
+    removeFromPeople(h.slot);
+    leg_slots.erase(slots[h.slot].legId);
+    slots[h.slot].alive = false;
+    slots[h.slot].generation++;
+    slots[h.slot].index = -1;
+    free_slots.push_back(h.slot);
+  }
+
+  void clear()
+  {
+    for (int i = 0; i < slots.size(); i++)
+    {
+      if (slots[i].alive)
+      {
+	slots[i].alive = false;
+	slots[i].generation++;
+	slots[i].index = -1;
+	free_slots.push_back(i);
+      }
+    }
+    leg_slots.clear();
+    people_slots.clear();
+  }
+
+  void setIndex(const TrackHandle& h, int index)
+  {
+    if (!isValid(h)) { return; }
+    slots[h.slot].index = index;
+  }
+
+  int getIndex(const TrackHandle& h) const
+  {
+    if (!isValid(h)) { return -1; }
+    return slots[h.slot].index;
+  }
+
+  int getIndexOfLeg(unsigned int legId) const
+  {
+    std::unordered_map<unsigned int, int>::const_iterator it = leg_slots.find(legId);
+    if (it == leg_slots.end()) { return -1; }
+    return slots[it->second].index;
+  }
+
+  // index of a leg that lost the people id to this one, -1 if there is none
+  int setPeopleId(const TrackHandle& h, int peopleId)
+  {
+    if (!isValid(h) || slots[h.slot].peopleId == peopleId) { return -1; }
+    removeFromPeople(h.slot);
+    if (peopleId == -1) { return -1; }
+    return addToPeople(h.slot, peopleId);
+  }
+
+  // index of the other leg with the same people id, -1 if there is none
+  int getPartnerIndex(const TrackHandle& h) const
+  {
+    if (!isValid(h) || slots[h.slot].peopleId == -1) { return -1; }
+    std::unordered_map<int, std::pair<int, int> >::const_iterator it = people_slots.find(slots[h.slot].peopleId);
+    if (it == people_slots.end()) { return -1; }
+    int partner = it->second.first == h.slot ? it->second.second : it->second.first;
+    if (partner == -1) { return -1; }
+    return slots[partner].index;
+  }
+
+  // indices of the legs of a person, -1 for a missing leg
+  std::pair<int, int> getPeopleIndices(int peopleId) const
+  {
+    std::unordered_map<int, std::pair<int, int> >::const_iterator it = people_slots.find(peopleId);
+    if (it == people_slots.end()) { return std::make_pair(-1, -1); }
+    int fst = it->second.first == -1 ? -1 : slots[it->second.first].index;
+    int snd = it->second.second == -1 ? -1 : slots[it->second.second].index;
+    return std::make_pair(fst, snd);
+  }
+
+  int getNumberOfSlots() const
+  {
+    return slots.size();
+  }
+};
+
+#endif
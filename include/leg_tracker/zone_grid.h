@@ -0,0 +1,95 @@
+#ifndef LEG_TRACKER_ZONE_GRID_H
+#define LEG_TRACKER_ZONE_GRID_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <leg_tracker/bounding_box.h>
+
+// Uniform grid over the tracking zones. Each cell lists the zones overlapping
+// it in ascending order, so a point is binned to the first zone containing it
+// with a single cell lookup.
+class ZoneGrid
+{
+
+private:
+  static const int max_cells_per_axis = 64;
+
+  double min_x;
+  double min_y;
+  double max_x;
+  double max_y;
+  double cell_size;
+  int cols;
+  int rows;
+  std::vector<std::vector<int> > cells;
+
+  int cellIndex(int cx, int cy) const
+  {
+    return cy * cols + cx;
+  }
+
+public:
+  ZoneGrid() : min_x(0.), min_y(0.), max_x(0.), max_y(0.), cell_size(1.), cols(0), rows(0) {}
+
+  void build(const std::vector<BoundingBox>& zones, double min_cell_size)
+  {
+    for (int i = 0; i < cells.size(); i++) { cells[i].clear(); }
+    cols = rows = 0;
+    if (zones.size() == 0) { return; }
+
+    min_x = zones[0].getXLowerLimit();
+    min_y = zones[0].getYLowerLimit();
+    max_x = zones[0].getXUpperLimit();
+    max_y = zones[0].getYUpperLimit();
+    for (int i = 1; i < zones.size(); i++)
+    {
+      min_x = std::min(min_x, zones[i].getXLowerLimit());
+      min_y = std::min(min_y, zones[i].getYLowerLimit());
+      max_x = std::max(max_x, zones[i].getXUpperLimit());
+      max_y = std::max(max_y, zones[i].getYUpperLimit());
+    }
+
+    cell_size = std::max(min_cell_size, std::max(max_x - min_x, max_y - min_y) / max_cells_per_axis);
+    cols = std::min(max_cells_per_axis, int((max_x - min_x) / cell_size) + 1);
+    rows = std::min(max_cells_per_axis, int((max_y - min_y) / cell_size) + 1);
+    if (cells.size() < cols * rows) { cells.resize(cols * rows); }
+
+    for (int i = 0; i < zones.size(); i++)
+    {
+      int cx_min = std::min(cols - 1, int((zones[i].getXLowerLimit() - min_x) / cell_size));
+      int cx_max = std::min(cols - 1, int((zones[i].getXUpperLimit() - min_x) / cell_size));
+      int cy_min = std::min(rows - 1, int((zones[i].getYLowerLimit() - min_y) / cell_size));
+      int cy_max = std::min(rows - 1, int((zones[i].getYUpperLimit() - min_y) / cell_size));
+      for (int cy = cy_min; cy <= cy_max; cy++)
+      {
+	for (int cx = cx_min; cx <= cx_max; cx++)
+	{
+	  cells[cellIndex(cx, cy)].push_back(i);
+	}
+      }
+    }
+  }
+
+  // index of the first zone containing (x, y), -1 if there is none
+  int findZone(double x, double y, const std::vector<BoundingBox>& zones) const
+  {
+    if (cols == 0 || x < min_x || y < min_y || x > max_x || y > max_y) { return -1; }
+    int cx = std::min(cols - 1, int((x - min_x) / cell_size));
+    int cy = std::min(rows - 1, int((y - min_y) / cell_size));
+
+    const std::vector<int>& cell = cells[cellIndex(cx, cy)];
+    for (int k = 0; k < cell.size(); k++)
+    {
+      const BoundingBox& b = zones[cell[k]];
+      if (x >= b.getXLowerLimit() && x <= b.getXUpperLimit() &&
+	  y >= b.getYLowerLimit() && y <= b.getYUpperLimit())
+      {
+	return cell[k];
+      }
+    }
+    return -1;
+  }
+};
+
+#endif
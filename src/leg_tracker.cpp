@@ -12,7 +12,19 @@ void LegDetector::init()
     resetLeftRight();
 
     nh_.param("scan_topic", scan_topic, std::string("/scan_unified"));
+    nh_.param("cloud_topic", cloud_topic, std::string(""));
+    nh_.param("scan_topics", scan_topics, std::vector<std::string>());
+    nh_.param("max_scan_delay", max_scan_delay, 0.1);
+    nh_.param("pipelined", pipelined, false);
+    pipeline_running = false;
+    view_sensor = NULL;
+    nh_.param("cloud_band_height", cloud_band_height, 0.2);
+    nh_.param("cloud_angle_increment", cloud_angle_increment, 0.0044);
+    nh_.param("cloud_range_min", cloud_range_min, 0.1);
+    nh_.param("cloud_range_max", cloud_range_max, 30.0);
     nh_.param("frequency", frequency, 0.05);
+    scan_clock.reset(frequency);
+    scan_period = frequency;
     nh_.param("transform_link", transform_link, std::string("base_link"));
     nh_.param("global_map_topic", global_map_topic, std::string("/move_base/global_costmap/costmap"));
     nh_.param("x_lower_limit", x_lower_limit, 0.0);
@@ -31,12 +43,16 @@ void LegDetector::init()
     nh_.param("z_coordinate", z_coordinate, 0.178);
     nh_.param("vel_stance_threshold", vel_stance_threshold, 0.47);
     nh_.param("vel_swing_threshold", vel_swing_threshold, 0.93);
+    nh_.param("stance_fast_path", stance_fast_path, false);
+    nh_.param("stance_entry_updates", stance_entry_updates, 3);
     nh_.param("state_dimensions", state_dimensions, 6);
+    loadLegFilterParams();
     nh_.param("minClusterSize", minClusterSize, 3);
     nh_.param("maxClusterSize", maxClusterSize, 100);
     nh_.param("clusterTolerance", clusterTolerance, 0.07);
     nh_.param("isOnePersonToTrack", isOnePersonToTrack, false);
     nh_.param("isBoundingBoxTracking", isBoundingBoxTracking, false);
+    nh_.param("optimal_leg_pairing", optimal_leg_pairing, false);
     nh_.param("with_map", with_map, false);
     nh_.param("occluded_dead_age", occluded_dead_age, 10);
     nh_.param("variance_observation", variance_observation, 0.25);
@@ -51,13 +67,86 @@ void LegDetector::init()
     nh_.param("cluster_bounding_box_uncertainty", cluster_bounding_box_uncertainty, 0.03);
     nh_.param("outlier_removal_radius", outlier_removal_radius, 0.07);
     nh_.param("max_neighbors_for_outlier_removal", max_neighbors_for_outlier_removal, 3);
+    nh_.param("circle_fitting", circle_fitting, std::string("centroid"));
+    nh_.param("ransac_dist_threshold", ransac_dist_threshold, 0.01);
+    nh_.param("ransac_max_iterations", ransac_max_iterations, 20);
+    nh_.param("cluster_split_iterations", cluster_split_iterations, 5);
+    nh_.param("cluster_classifier_model", cluster_classifier_model, std::string(""));
+    if (cluster_classifier_model != "" && !cluster_classifier.load(cluster_classifier_model))
+    {
+      ROS_ERROR("Cluster classifier model %s could not be loaded, all clusters are kept", cluster_classifier_model.c_str());
+    }
+    nh_.param("lost_people_capacity", lost_people_capacity, 64);
+    nh_.param("lost_people_timeout", lost_people_timeout, 5.0);
+    nh_.param("lost_people_timeout_near_limits", lost_people_timeout_near_limits, 1.0);
+    lost_people.configure(lost_people_capacity, max_dist_btw_legs);
+    nh_.param("person_gating", person_gating, false);
+    nh_.param("person_gate", person_gate, 9.21);
+    nh_.param("person_process_noise", person_process_noise, 1.0);
+    nh_.param("person_measurement_noise", person_measurement_noise, 0.01);
+    lost_legs.configure(lost_people_capacity, max_dist_btw_legs);
+    nh_.param("sensor_moved_distance", sensor_moved_distance, 0.05);
+    nh_.param("sensor_moved_angle", sensor_moved_angle, 0.02);
+    nh_.param("background_subtraction", background_subtraction, false);
+    nh_.param("background_fixed_frame", background_fixed_frame, std::string("odom"));
+    nh_.param("background_tolerance", background_tolerance, 0.1);
+    nh_.param("background_learning_scans", background_learning_scans, 100);
+    background_model.configure(background_tolerance, background_learning_scans);
+    background_pose.valid = false;
+    nh_.param("map_ray_casting", map_ray_casting, false);
+    nh_.param("map_range_tolerance", map_range_tolerance, 0.1);
+    nh_.param("map_occupied_threshold", map_occupied_threshold, 100);
+    map_version = expected_ranges_map_version = 0;
+    nh_.param("idle_gate", idle_gate, false);
+    nh_.param("idle_range_tolerance", idle_range_tolerance, 0.05);
+    nh_.param("idle_changed_beams", idle_changed_beams, 3);
+    idle = false;
+    nh_.param("attention_mode", attention_mode, false);
+    nh_.param("attention_full_scan_every", attention_full_scan_every, 10);
+    nh_.param("attention_entry_band", attention_entry_band, 0.5);
+    attention_frame = 0;
+    nh_.param("polar_gating", polar_gating, false);
+    nh_.param("clustering_mode", clustering_mode, std::string("euclidean"));
+    if (clustering_mode == "scan_order")
+    {
+      // the segments are taken from the scan, the point cloud filter with its outlier removal and map check is not run
+      ROS_WARN("scan_order clustering skips the outlier removal of the point cloud filter");
+      if (with_map && !map_ray_casting)
+      {
+	ROS_WARN("scan_order clustering does not check the clusters against the map, map_ray_casting is enabled instead");
+	map_ray_casting = true;
+      }
+    }
+    nh_.param("segment_change_threshold", segment_change_threshold, 0.02);
+    scan_segmenter.configure(clusterTolerance, segment_change_threshold, minClusterSize, maxClusterSize);
+    segmenter_pose.valid = false;
+    nh_.param("clustering_time_budget", clustering_time_budget, 0.0);
+    nh_.param("clustering_far_range", clustering_far_range, 4.0);
+    nh_.param("arc_length_decimation", arc_length_decimation, false);
+    // a leg keeps minClusterSize points, a point enough neighbours for the outlier removal and clusters stay connected
+    arc_length_spacing = std::min(2. * leg_radius / (minClusterSize + 1), 
+      std::min(outlier_removal_radius / std::ceil(max_neighbors_for_outlier_removal / 2.), clusterTolerance));
+    degradation_level = leg_tracker::FrameStats::FULL;
+    expected_ranges_pose.valid = false;
     
     legs_gathered = id_counter = legs_marker_next_id = next_leg_id = people_marker_next_id = 
 	cov_ellipse_id = 0;
     got_map = false;
     got_map_from_service = false;
 
-    sub = nh_.subscribe<sensor_msgs::LaserScan>(scan_topic, 1, &LegDetector::processLaserScan, this);
+    if (!scan_topics.empty())
+    {
+      // subscribed at the end, the workers start right away
+    }
+    else if (cloud_topic.empty())
+    {
+      sub = nh_.subscribe<sensor_msgs::LaserScan>(scan_topic, 1, 
+	pipelined ? &LegDetector::queueLaserScan : &LegDetector::processLaserScan, this);
+    }
+    else
+    {
+      sub = nh_.subscribe<sensor_msgs::PointCloud2>(cloud_topic, 1, &LegDetector::processPointCloud, this);
+    }
     global_map_sub = nh_.subscribe<nav_msgs::OccupancyGrid>(global_map_topic, 10, &LegDetector::globalMapCallback, this);
     pos_vel_acc_fst_leg_pub = nh_.advertise<leg_tracker::LegTrackerMessage>("posXY_velXY_accXY_lId_pId_conf_fst_leg", 300);
     pos_vel_acc_snd_leg_pub = nh_.advertise<leg_tracker::LegTrackerMessage>("posXY_velXY_accXY_lId_pId_conf_snd_leg", 300);
@@ -68,11 +157,39 @@ void LegDetector::init()
     cov_marker_pub = nh_.advertise<visualization_msgs::MarkerArray>("cov_ellipses", 10);
     
     people_msg_pub = nh_.advertise<leg_tracker::PersonMsg>("people_msg_stamped", 10);
+    frame_stats_pub = nh_.advertise<leg_tracker::FrameStats>("frame_stats", 10);
     
 //     bounding_box_pub = nh_.advertise<visualization_msgs::Marker>("bounding_box", 300);
     tracking_zone_pub = nh_.advertise<visualization_msgs::MarkerArray>("tracking_zones", 100);
 //     paths_publisher = nh_.advertise<visualization_msgs::MarkerArray>("paths", 100);
 //     client = nh_.serviceClient<nav_msgs::GetMap>("static_map");
+    
+    if (!scan_topics.empty()) { startScanSensors(); }
+    else if (pipelined) { startPipeline(); }
+  }
+  
+  
+  void LegDetector::startScanSensors()
+  {
+    for (int i = 0; i < scan_topics.size(); i++)
+    {
+      boost::shared_ptr<ScanSensor> sensor(new ScanSensor());
+      sensor->topic = scan_topics[i];
+      sensor->latency = 0.;
+      sensor->clock.reset(frequency);
+      sensor->pose.valid = false;
+      scan_sensors.push_back(sensor);
+    }
+    for (int i = 0; i < scan_sensors.size(); i++)
+    {
+      ScanSensor& sensor = *scan_sensors[i];
+      ros::SubscribeOptions options = ros::SubscribeOptions::create<sensor_msgs::LaserScan>(sensor.topic, 1, 
+	boost::bind(&LegDetector::processSensorScan, this, _1, i), ros::VoidPtr(), &sensor.queue);
+      sensor.sub = nh_.subscribe(options);
+      sensor.spinner.reset(new ros::AsyncSpinner(1, &sensor.queue));
+      sensor.spinner->start();
+      ROS_INFO("Fusing scans of %s", sensor.topic.c_str());
+    }
   }
   
   
@@ -84,7 +201,9 @@ void LegDetector::init()
   
   void LegDetector::globalMapCallback(const nav_msgs::OccupancyGrid::ConstPtr& msg) 
   {
+    std::lock_guard<std::mutex> lock(tracking_mutex);
     global_map = *msg;
+    map_version++;
     if (!got_map) { got_map = true; }
   }
   
@@ -152,6 +271,108 @@ void LegDetector::init()
     return true;
   }
   
+  bool LegDetector::lookupSensorPose(const std::string& fixed_frame, std::string sensor_frame, SensorPose& pose)
+  {
+    if (sensor_frame.size() != 0 && sensor_frame[0] == '/') { sensor_frame.replace(0, 1, ""); }
+    geometry_msgs::TransformStamped transformStamped;
+    try{
+      transformStamped = tfBuffer.lookupTransform(fixed_frame, sensor_frame, ros::Time(0));
+    }
+    catch (tf2::TransformException &ex) {
+      ROS_DEBUG("Sensor pose: %s", ex.what());
+      pose.valid = false;
+      return false;
+    }
+    const geometry_msgs::Quaternion& q = transformStamped.transform.rotation;
+    pose.x = transformStamped.transform.translation.x;
+    pose.y = transformStamped.transform.translation.y;
+    pose.yaw = std::atan2(2. * (q.w * q.z + q.x * q.y), 1. - 2. * (q.y * q.y + q.z * q.z));
+    pose.valid = true;
+    return true;
+  }
+
+  bool LegDetector::sensorMoved(const SensorPose& from, const SensorPose& to)
+  {
+    if (!from.valid || !to.valid) { return true; }
+    double angle = std::fabs(std::atan2(std::sin(to.yaw - from.yaw), std::cos(to.yaw - from.yaw)));
+    return distanceBtwTwoPoints(from.x, from.y, to.x, to.y) > sensor_moved_distance || angle > sensor_moved_angle;
+  }
+
+  void LegDetector::rayCastExpectedRanges(const SensorPose& pose, const sensor_msgs::LaserScan& scan)
+  {
+    expected_ranges.assign(scan.ranges.size(), std::numeric_limits<float>::quiet_NaN());
+    double resolution = global_map.info.resolution;
+    int width = global_map.info.width;
+    int height = global_map.info.height;
+    if (resolution <= 0. || global_map.data.size() < width * height) { return; }
+    double step = resolution / 2.;
+    for (int i = 0; i < scan.ranges.size(); i++)
+    {
+      double angle = pose.yaw + scan.angle_min + i * scan.angle_increment;
+      double dx = std::cos(angle), dy = std::sin(angle);
+      for (double t = scan.range_min; t <= scan.range_max; t += step)
+      {
+	int map_x = int(std::floor((pose.x + t * dx - global_map.info.origin.position.x) / resolution));
+	int map_y = int(std::floor((pose.y + t * dy - global_map.info.origin.position.y) / resolution));
+	if (map_x < 0 || map_y < 0 || map_x >= width || map_y >= height) { break; }
+	if (global_map.data[map_x + map_y * width] >= map_occupied_threshold) 
+	{ 
+	  expected_ranges[i] = t; 
+	  break; 
+	}
+      }
+    }
+    expected_ranges_pose = pose;
+    expected_ranges_map_version = map_version;
+  }
+
+  void LegDetector::maskStaticBeams(sensor_msgs::LaserScan& scan)
+  {
+    if (with_map && got_map && map_ray_casting)
+    {
+      SensorPose pose;
+      if (lookupSensorPose(global_map.header.frame_id, scan.header.frame_id, pose))
+      {
+	// ray casting once per map and sensor pose, a parked robot never casts again
+	if (expected_ranges_map_version != map_version || expected_ranges.size() != scan.ranges.size() || 
+	  sensorMoved(expected_ranges_pose, pose))
+	{
+	  rayCastExpectedRanges(pose, scan);
+	}
+	for (int i = 0; i < scan.ranges.size(); i++)
+	{
+	  if (std::fabs(scan.ranges[i] - expected_ranges[i]) <= map_range_tolerance) 
+	  { 
+	    scan.ranges[i] = std::numeric_limits<float>::quiet_NaN(); 
+	  }
+	}
+      }
+    }
+    
+    if (background_subtraction)
+    {
+      SensorPose pose;
+      if (lookupSensorPose(background_fixed_frame, scan.header.frame_id, pose))
+      {
+	// the background only holds for the pose it was learned at
+	if (sensorMoved(background_pose, pose))
+	{
+	  if (background_model.size() != 0) { ROS_DEBUG("Background model: sensor has moved, learning again"); }
+	  background_model.reset();
+	  background_pose = pose;
+	}
+	background_model.update(scan.ranges, scan.range_min, scan.range_max);
+	for (int i = 0; i < scan.ranges.size(); i++)
+	{
+	  if (background_model.isBackground(i, scan.ranges[i])) 
+	  { 
+	    scan.ranges[i] = std::numeric_limits<float>::quiet_NaN(); 
+	  }
+	}
+      }
+    }
+  }
+  
   void LegDetector::pub_leg_posvelacc(std::vector<double>& in, bool isSnd, std_msgs::Header header)
   {
     // 3 values for legId peopleId and confidence
@@ -178,6 +399,27 @@ void LegDetector::init()
     else { pos_vel_acc_snd_leg_pub.publish(msg); }
   }
 
+  // keeps the points of a cloud in scan order about arc_length_spacing apart, 
+  // a point is dropped only if the next one is still within the spacing of the last kept one
+  void LegDetector::decimateByArcLength(PointCloud& cloud)
+  {
+    if (cloud.points.size() < 3) { return; }
+    
+    int kept = 1;
+    for (int i = 1; i + 1 < cloud.points.size(); i++)
+    {
+      const Point& last = cloud.points[kept - 1];
+      if (distanceBtwTwoPoints(last.x, last.y, cloud.points[i + 1].x, cloud.points[i + 1].y) <= arc_length_spacing) { continue; }
+      cloud.points[kept++] = cloud.points[i];
+    }
+    cloud.points[kept++] = cloud.points.back();
+    
+    ROS_DEBUG("Decimation: %d of %d points kept", kept, (int) cloud.points.size());
+    cloud.points.resize(kept);
+    cloud.width = kept;
+    cloud.height = 1;
+  }
+
   // pass through filtering, outlier removal
   bool LegDetector::filterPCLPointCloud(const PointCloud& in, PointCloud& out)
   {
@@ -282,10 +524,39 @@ void LegDetector::init()
   }
 
   
+  void LegDetector::loadLegFilterParams()
+  {
+    // dt, Q, R and P of the KalmanFilter parameters, A and C are those of the constant acceleration model
+    std::vector<double> q, r, p;
+    nh_.param("KalmanFilter/dt", leg_filter_params.dt, frequency);
+    if (!nh_.getParam("KalmanFilter/Q", q) || q.size() != 36 || !nh_.getParam("KalmanFilter/R", r) || r.size() != 4 ||
+      !nh_.getParam("KalmanFilter/P", p) || p.size() != 36)
+    {
+      ROS_WARN("KalmanFilter parameters are missing, the defaults of kalman_filter.yaml are used");
+      q.assign(36, 0.); r.assign(4, 0.); p.assign(36, 0.);
+      for (int i = 0; i < 6; i++) { q[i * 7] = 0.1; p[i * 7] = 0.45; }
+      r[0] = r[3] = 0.012;
+    }
+    for (int i = 0; i < 6; i++)
+    {
+      for (int j = 0; j < 6; j++)
+      {
+	leg_filter_params.Q(i, j) = q[i * 6 + j];
+	leg_filter_params.P0(i, j) = p[i * 6 + j];
+      }
+    }
+    for (int i = 0; i < 2; i++)
+    {
+      for (int j = 0; j < 2; j++) { leg_filter_params.R(i, j) = r[i * 2 + j]; }
+    }
+  }
+
   Leg LegDetector::initLeg(const Point& p)
   {
-    Leg l(getNextLegId(), p, occluded_dead_age,
-      variance_observation, min_observations, state_dimensions, min_dist_travelled);
+    Leg l(getNextLegId(), p, current_stamp.toSec(), &leg_filter_params, occluded_dead_age,
+      variance_observation, min_observations, state_dimensions, min_dist_travelled,
+      stance_fast_path ? vel_stance_threshold : 0., vel_swing_threshold, frequency, stance_entry_updates);
+    l.setHandle(track_index.insert(l.getLegId()));
     return l;
   }
 
@@ -297,9 +568,12 @@ void LegDetector::init()
     {
       double confidence = l.hasPair() * std::max(0., (1 - 0.15 * l.getOccludedAge()));
       std::string left_or_right_leg = "unknown"; 
-      if (left_right.first != -1)
+      double conf_left_right = 0.;
+      std::map<int, Person>::iterator it = persons.find(l.getPeopleId());
+      if (it != persons.end() && it->second.getGait().left_right.first != -1)
       {
-	left_or_right_leg = (left_right.first == l.getLegId() ? "left" : "right");
+	left_or_right_leg = (it->second.getGait().left_right.first == l.getLegId() ? "left" : "right");
+	conf_left_right = it->second.getGait().conf_left_right;
       }
       
       double angle = atan2(l.getPos().y, l.getPos().x);
@@ -347,7 +621,7 @@ void LegDetector::init()
       double pos_y = l.getPos().y;
       visualization_msgs::Marker m = getArrowMarker(pos_x, pos_y,
 	       pos_x + 0.5 * l.getVel().x, pos_y + 0.5 * l.getVel().y, getNextLegsMarkerId());
-      if (left_right.first == l.getLegId())
+      if (getLegSide(l.getPeopleId(), l.getLegId()) == leg_tracker::LegMsg::LEFT)
       {
 	m.color.r = 0.;
 	m.color.b = 1.0;
@@ -406,12 +680,12 @@ void LegDetector::init()
 	{
 	  if (legs[i].getOccludedAge() < 3)
 	  {
-	    legs[i].predict();
+	    predictLeg(legs[i]);
 	  }
 	}
 	else if (legs.size() == 1)
 	{
-	  legs[0].predict();
+	  predictLeg(legs[0]);
 	}
 	
 	if (legs[i].getPos().x > x_upper_limit || legs[i].getPos().y > y_upper_limit || 
@@ -436,6 +710,7 @@ void LegDetector::init()
     if (toReset) 
     {
       legs.clear();
+      track_index.clear();
       resetTrackingZone();
       resetLeftRight();
       return;
@@ -446,7 +721,7 @@ void LegDetector::init()
     { 
       for (int i = 0; i < legs.size(); i++)
       {
-	legs[i].missed();
+	missLeg(legs[i]);
       }
       return; 
     }
@@ -456,9 +731,7 @@ void LegDetector::init()
       double min_dist = max_cost;
       int index = -1;
       for (int i = 0; i < legs.size(); i++) {
-	double cov = legs[i].getMeasToTrackMatchingCov();
-	double mahalanobis_dist = std::sqrt((std::pow((p.x - legs[i].getPos().x), 2) +
-	  std::pow((p.y - legs[i].getPos().y), 2)) / cov);
+	double mahalanobis_dist = legs[i].mahalanobisDist(p);
 	double euclid_dist = distanceBtwTwoPoints(p, legs[i].getPos());
 	if (legs.size() == 2)
 	{
@@ -476,23 +749,21 @@ void LegDetector::init()
       }
       if (index != -1)
       {
-	legs[index].update(p);
+	updateLeg(legs[index], p);
 	
 	// clear cloud 
 	cluster_centroids.points.clear();
 	
 	if (legs.size() == 2)
 	{
-	  legs[1 - index].missed();
+	  missLeg(legs[1 - index]);
 	}
       }
     } else if (legs.size() == 1) {
       double min_dist = max_cost;
       int index = -1;
       for (int i = 0; i < cluster_centroids.points.size(); i++) {
-	double cov = legs[0].getMeasToTrackMatchingCov();
-	double mahalanobis_dist = std::sqrt((std::pow((cluster_centroids.points[i].x - legs[0].getPos().x), 2) +
-	  std::pow((cluster_centroids.points[i].y - legs[0].getPos().y), 2)) / cov);
+	double mahalanobis_dist = legs[0].mahalanobisDist(cluster_centroids.points[i]);
 	double euclid_dist = distanceBtwTwoPoints(cluster_centroids.points[i], legs[0].getPos());
 	if (euclid_dist <= 0.05)
 	{
@@ -507,18 +778,16 @@ void LegDetector::init()
       }
       if (index != -1)  
       { 
-	legs[0].update(cluster_centroids.points[index]);
+	updateLeg(legs[0], cluster_centroids.points[index]);
 	cluster_centroids.points.erase(cluster_centroids.points.begin() + index);
       }	
       else
       {
-	legs[0].missed();
+	missLeg(legs[0]);
       }
     } else if (legs.size() == 2 && cluster_centroids.points.size() > 1) {
       
       double total_cost = max_cost;
-      double fst_cov = legs[0].getMeasToTrackMatchingCov();
-      double snd_cov = legs[1].getMeasToTrackMatchingCov();
       int fst_index = -1, snd_index = -1;
       int best_fst_index = -1, best_snd_index = -1;
       
@@ -533,8 +802,7 @@ void LegDetector::init()
 	}
 	else
 	{
-	  fst_cost = std::sqrt((std::pow((cluster_centroids.points[i].x - legs[0].getPos().x), 2) +
-	    std::pow((cluster_centroids.points[i].y - legs[0].getPos().y), 2)) / fst_cov);
+	  fst_cost = legs[0].mahalanobisDist(cluster_centroids.points[i]);
 	}
 	for (int j = 0; j < cluster_centroids.points.size(); j++) {
 	  if (i == j) { continue; }
@@ -548,8 +816,7 @@ void LegDetector::init()
 	  }
 	  else
 	  {
-	    snd_cost = std::sqrt((std::pow((cluster_centroids.points[j].x - legs[1].getPos().x), 2) +
-		std::pow((cluster_centroids.points[j].y - legs[1].getPos().y), 2)) / snd_cov);
+	    snd_cost = legs[1].mahalanobisDist(cluster_centroids.points[j]);
 	  }
 	  
 	  if (fst_cost + snd_cost < total_cost) {
@@ -562,28 +829,28 @@ void LegDetector::init()
       
       if (fst_index != -1)
       {
-	legs[0].update(cluster_centroids.points[fst_index]);
+	updateLeg(legs[0], cluster_centroids.points[fst_index]);
       }
       else if (best_fst_index != -1)
       {
-	legs[0].update(cluster_centroids.points[best_fst_index]);
+	updateLeg(legs[0], cluster_centroids.points[best_fst_index]);
       }
       else
       {
-	legs[0].missed();
+	missLeg(legs[0]);
       }
       
       if (snd_index != -1)
       {
-	legs[1].update(cluster_centroids.points[snd_index]);
+	updateLeg(legs[1], cluster_centroids.points[snd_index]);
       }
       else if (best_snd_index != -1)
       {
-	legs[1].update(cluster_centroids.points[best_snd_index]);
+	updateLeg(legs[1], cluster_centroids.points[best_snd_index]);
       }
       else
       {
-	legs[1].missed();
+	missLeg(legs[1]);
       }
     } 
     
@@ -644,6 +911,7 @@ void LegDetector::init()
       {
 	used_point_index = index;
 	legs.push_back(initLeg(cluster_centroids.points[index]));
+	track_index.setIndex(legs.back().getHandle(), legs.size() - 1);
       } 
       else
       {
@@ -697,8 +965,8 @@ void LegDetector::init()
     int pId = legs[i].getPeopleId();
     legs[i].setHasPair(false);
     legs[j].setHasPair(false);
-    legs[i].setPeopleId(-1);
-    legs[j].setPeopleId(-1);
+    setLegPeopleId(i, -1);
+    setLegPeopleId(j, -1);
     
     if (isBoundingBoxTracking)
     {
@@ -719,15 +987,11 @@ void LegDetector::init()
     for (int i = 0; i < legs.size(); i++)
     {
       if (!legs[i].hasPair()) { continue; }
-      for (int j = i + 1; j < legs.size(); j++)
+      int j = track_index.getPartnerIndex(legs[i].getHandle());
+      if (j <= i) { continue; }
+      if (distanceBtwTwoPoints(legs[i].getPos(), legs[j].getPos()) > max_dist_btw_legs)
       {
-	if (legs[i].getPeopleId() == legs[j].getPeopleId()) {
-	  if (distanceBtwTwoPoints(legs[i].getPos(), legs[j].getPos()) > max_dist_btw_legs)
-	  {
-	    separateLegs(i, j);
-	  }
-	  break;
-	}
+	separateLegs(i, j);
       }
     }
   }
@@ -736,6 +1000,12 @@ void LegDetector::init()
   void LegDetector::findPeople()
   {
     checkDistanceOfLegs();
+    updateLegAffinity();
+    if (optimal_leg_pairing)
+    {
+      pairLegsByAssignment();
+      return;
+    }
     for (int i = 0; i < legs.size(); i++)
     {
       if (legs[i].hasPair() || (legs[i].getPeopleId() == -1 && legs[i].getObservations() < min_observations)) 
@@ -765,47 +1035,11 @@ void LegDetector::init()
     int snd_leg = -1;
     
     double max_gain = 0.;
+    int fst_slot = legs[fst_leg].getHandle().slot;
     for (int i = 0; i < indices_of_potential_legs.size(); i++)
     {
-      double gain = 0.;
-      bool isHistoryDistanceValid = true;
-      int history_size = legs[fst_leg].getHistory().size();
-      if (history_size != min_observations || 
-	legs[indices_of_potential_legs[i]].getHistory().size() != history_size)
-      {
-        ROS_WARN("History check: vectors are not equal in size!");
-        return;
-      }
-      for (int j = 0; j < history_size - 1; j++)
-      {
-	int fst_history_size = legs[fst_leg].getHistory()[j].size();
-	int snd_history_size = legs[indices_of_potential_legs[i]].getHistory()[j].size();
-	
-	if (fst_history_size != state_dimensions || snd_history_size != state_dimensions)
-	{
-	  ROS_WARN("History check: stae vectors are not valid!");
-	  return;
-	}
-	
-	double dist = distanceBtwTwoPoints(legs[fst_leg].getHistory()[j][0], 
-					   legs[fst_leg].getHistory()[j][1],
-	  legs[indices_of_potential_legs[i]].getHistory()[j][0], 
-	  legs[indices_of_potential_legs[i]].getHistory()[j][1]);
-	
-	if (dist > max_dist_btw_legs)
-	{
-	  ROS_DEBUG("History check: distance is not valid!");
-	  isHistoryDistanceValid = false;
-	  break;
-	}
-	
-        double forgettingFactor = std::pow(0.5, history_size - 1 - j);
-        gain += forgettingFactor * (1 - dist / std::sqrt(200));
-      }
-
-      gain /= history_size;
-      
-      if (!isHistoryDistanceValid) { continue; }
+      double gain = leg_affinity.get(fst_slot, legs[indices_of_potential_legs[i]].getHandle().slot);
+      if (gain < 0.) { continue; }
       if (max_gain < gain) {
         max_gain = gain;
         snd_leg = indices_of_potential_legs[i];
@@ -816,6 +1050,119 @@ void LegDetector::init()
 
     setPeopleId(fst_leg, snd_leg);
   }
+
+  bool LegDetector::isPairingCandidate(int i)
+  {
+    return !legs[i].hasPair() && (legs[i].getPeopleId() != -1 || legs[i].getObservations() >= min_observations);
+  }
+
+  void LegDetector::pairLegsByAssignment()
+  {
+    std::vector<int> candidates;
+    for (int i = 0; i < legs.size(); i++)
+    {
+      if (isPairingCandidate(i)) { candidates.push_back(i); }
+    }
+    int n = candidates.size();
+    if (n < 2) { return; }
+    
+    // weight 1 + history gain, so that a pair without a valid gain still counts, -1 for no edge
+    std::vector<std::vector<double> > weight(n, std::vector<double>(n, -1.));
+    std::vector<int> gated_count(n, 0);
+    for (int r = 0; r < n; r++)
+    {
+      for (int c = r + 1; c < n; c++)
+      {
+	Leg& fst = legs[candidates[r]];
+	Leg& snd = legs[candidates[c]];
+	double dist = distanceBtwTwoPoints(fst.getPos(), snd.getPos());
+	if (dist > max_dist_btw_legs || dist < leg_radius
+	  || (fst.getObservations() < min_observations && snd.getObservations() < min_observations)) 
+	{ continue; }
+	gated_count[r]++;
+	gated_count[c]++;
+	double gain = leg_affinity.get(fst.getHandle().slot, snd.getHandle().slot);
+	if (gain >= 0.) { weight[r][c] = weight[c][r] = 1. + gain; }
+      }
+    }
+    
+    // like the greedy pairing, legs without a valid history gain are only paired
+    // if they are the only candidate of each other
+    for (int r = 0; r < n; r++)
+    {
+      for (int c = r + 1; c < n; c++)
+      {
+	if (weight[r][c] >= 0. || gated_count[r] != 1 || gated_count[c] != 1) { continue; }
+	double dist = distanceBtwTwoPoints(legs[candidates[r]].getPos(), legs[candidates[c]].getPos());
+	if (dist <= max_dist_btw_legs && dist >= leg_radius) { weight[r][c] = weight[c][r] = 1.; }
+      }
+    }
+    
+    // the gated candidates fall apart into small groups, each one is matched exactly
+    std::vector<int> mate;
+    if (!maxWeightMatching(weight, mate))
+    {
+      ROS_DEBUG("Leg pairing: a group of more than 16 candidate legs was paired greedily");
+    }
+    for (int r = 0; r < n; r++)
+    {
+      if (mate[r] > r) { setPeopleId(candidates[r], candidates[mate[r]]); }
+    }
+  }
+
+  double LegDetector::historyGain(const Leg& fst, const Leg& snd)
+  {
+    const LegHistory& fst_history = fst.getHistory();
+    const LegHistory& snd_history = snd.getHistory();
+    if (!fst_history.full() || !snd_history.full())
+    {
+      ROS_DEBUG("History check: histories are not complete!");
+      return -1.;
+    }
+    
+    int history_size = fst_history.capacity();
+    double gain = 0.;
+    for (int age = 0; age < history_size - 1; age++)
+    {
+      double dist = distanceBtwTwoPoints(fst_history[age].x, fst_history[age].y,
+					 snd_history[age].x, snd_history[age].y);
+      if (dist > max_dist_btw_legs)
+      {
+	ROS_DEBUG("History check: distance is not valid!");
+	return -1.;
+      }
+      double forgettingFactor = std::pow(0.5, age + 1);
+      gain += forgettingFactor * (1 - dist / std::sqrt(200));
+    }
+    return gain / history_size;
+  }
+
+  void LegDetector::updateLegAffinity()
+  {
+    leg_affinity.resize(track_index.getNumberOfSlots());
+    
+    std::vector<bool> dirty(legs.size());
+    for (int i = 0; i < legs.size(); i++)
+    {
+      dirty[i] = leg_affinity.isDirty(legs[i].getHandle(), legs[i].getHistoryRevision());
+    }
+    
+    // only rows of legs with a new history entry are recomputed
+    for (int i = 0; i < legs.size(); i++)
+    {
+      if (!dirty[i]) { continue; }
+      for (int j = 0; j < legs.size(); j++)
+      {
+	if (j == i || (dirty[j] && j < i)) { continue; }
+	leg_affinity.set(legs[i].getHandle().slot, legs[j].getHandle().slot, historyGain(legs[i], legs[j]));
+      }
+    }
+    
+    for (int i = 0; i < legs.size(); i++)
+    {
+      if (dirty[i]) { leg_affinity.markClean(legs[i].getHandle(), legs[i].getHistoryRevision()); }
+    }
+  }
   
 
   double LegDetector::distanceBtwTwoPoints(double x1, double y1, double x2, double y2)
@@ -840,15 +1187,12 @@ void LegDetector::init()
     peoplePos.x = (legs[fst_leg].getPos().x + legs[snd_leg].getPos().x) / 2;
     peoplePos.y = (legs[fst_leg].getPos().y + legs[snd_leg].getPos().y) / 2;
     
-    for (int i = 0; i < lastSeenPeoplePositions.size(); i++) 
+    const Tombstone* lastSeen = lost_people.findNearest(peoplePos.x, peoplePos.y, max_dist_btw_legs);
+    if (lastSeen != NULL) 
     {
-      Point lastPos = std::get<2>(lastSeenPeoplePositions[i]);
-      if (distanceBtwTwoPoints(peoplePos, lastPos) > max_dist_btw_legs) { continue; }
-      id = std::get<1>(lastSeenPeoplePositions[i]);
-      
+      id = lastSeen->peopleId;
       restoreId = true;
-      removeLastSeenPeoplePosition(i);
-      break;
+      lost_people.erase(id);
     }
     
     if (!restoreId || id == -1) 
@@ -876,8 +1220,8 @@ void LegDetector::init()
       }
     }
     
-    legs[fst_leg].setPeopleId(id);
-    legs[snd_leg].setPeopleId(id);
+    setLegPeopleId(fst_leg, id);
+    setLegPeopleId(snd_leg, id);
     legs[fst_leg].setHasPair(true);
     legs[snd_leg].setHasPair(true);
     
@@ -888,27 +1232,23 @@ void LegDetector::init()
     }
   }
 
-  void LegDetector::eraseRemovedLegsWithoutId()
+  void LegDetector::eraseRemovedLeg(int id)
   {
-    for (std::vector<Leg>::iterator it = removed_legs.begin(); it != removed_legs.end(); it++)
-    {
-      if (it->getPeopleId() == -1)
-      {
-	removed_legs.erase(it);
-      }
-    }
+    lost_legs.erase(id);
   }
 
-  void LegDetector::eraseRemovedLeg(int id)
+  Tombstone LegDetector::getTombstone(Leg& l, double x, double y, double timeout)
   {
-    for (std::vector<Leg>::iterator it = removed_legs.begin(); it != removed_legs.end(); it++)
-    {
-      if (it->getPeopleId() == id)
-      {
-	removed_legs.erase(it);
-	return;
-      }
-    }
+    Tombstone t;
+    t.peopleId = l.getPeopleId();
+    t.legId = l.getLegId();
+    t.x = x;
+    t.y = y;
+    t.vel_x = l.getVel().x;
+    t.vel_y = l.getVel().y;
+    t.stamp = current_stamp.toSec();
+    t.expires = t.stamp + timeout;
+    return t;
   }
   
   
@@ -979,8 +1319,22 @@ void LegDetector::init()
   }
   
   
-  void LegDetector::checkIfLeftOrRight(int i, int j)
+  int LegDetector::getLegSide(int peopleId, unsigned int legId)
+  {
+    std::map<int, Person>::iterator it = persons.find(peopleId);
+    if (it == persons.end()) { return leg_tracker::LegMsg::UNKNOWN; }
+    const std::pair<int, int>& left_right = it->second.getGait().left_right;
+    if (left_right.first == legId) { return leg_tracker::LegMsg::LEFT; }
+    if (left_right.second == legId) { return leg_tracker::LegMsg::RIGHT; }
+    return leg_tracker::LegMsg::UNKNOWN;
+  }
+  
+  void LegDetector::checkIfLeftOrRight(int i, int j, GaitState& gait)
   {
+    std::pair<int, int>& left_right = gait.left_right;
+    std::pair<int, int>& ij_or_ji = gait.ij_or_ji;
+    double& conf_left_right = gait.conf_left_right;
+
     if (legs[i].getPos().y <= legs[j].getPos().y)
     {
       // leg i is the right leg 
@@ -1079,50 +1433,37 @@ void LegDetector::init()
       int id = legs[i].getPeopleId();
       if (id == -1) { continue; }
 
-      	// second leg is removed
-        if (!legs[i].hasPair())
-        {
-        for (int j = 0; j < removed_legs.size(); j++)
-        {
-            if (legs[j].getPeopleId() == id)
-            {
-            if (distanceBtwTwoPoints(legs[i].getPos(), legs[j].getPos()) > max_dist_btw_legs) {
-                break;
-            }
-            updatePath(id, header, 
-                    legs[i].getPos().x,
-                    legs[i].getPos().y,
-                    legs[j].getPos().x, 
-                    legs[j].getPos().y);
-            ma_people.markers.push_back(getOvalMarkerForTwoPoints(id,
-                    legs[i].getPos().x,
-                    legs[i].getPos().y,
-                    legs[j].getPos().x, 
-                    legs[j].getPos().y, 
-                    getPeopleMarkerNextId()));
-            publish_person_msg_stamped(i, j, header);
-            break;
-            }
-        }
-
-        } 
-	else 
-	{
-	  for (int j = i + 1; j < legs.size(); j++)
-	  {
-	    if (legs[j].getPeopleId() == id)
-	    {
-	      updatePath(id, header, legs[i].getPos().x,
-		  legs[i].getPos().y, legs[j].getPos().x, legs[j].getPos().y);
-	      ma_people.markers.push_back(getOvalMarkerForTwoPoints(id, legs[i].getPos().x,
-		  legs[i].getPos().y, legs[j].getPos().x, legs[j].getPos().y, getPeopleMarkerNextId()));
-          publish_person_msg_stamped(i, j, header);
-	      
-	     checkIfLeftOrRight(i, j);
-	     
-	      break;
-	    }
-	  }
+      // second leg is removed
+      if (!legs[i].hasPair())
+      {
+	const Tombstone* removed_leg = lost_legs.find(id);
+	if (removed_leg == NULL) { continue; }
+	if (distanceBtwTwoPoints(legs[i].getPos().x, legs[i].getPos().y, 
+	  removed_leg->x, removed_leg->y) > max_dist_btw_legs) { continue; }
+	updatePath(id, header, 
+		legs[i].getPos().x,
+		legs[i].getPos().y,
+		removed_leg->x, 
+		removed_leg->y);
+	ma_people.markers.push_back(getOvalMarkerForTwoPoints(id,
+		legs[i].getPos().x,
+		legs[i].getPos().y,
+		removed_leg->x, 
+		removed_leg->y, 
+		getPeopleMarkerNextId()));
+	publish_person_msg_stamped(id, getLegMsg(legs[i]), getLegMsg(*removed_leg), header);
+      } 
+      else 
+      {
+	int j = track_index.getPartnerIndex(legs[i].getHandle());
+	if (j <= i) { continue; }
+	updatePath(id, header, legs[i].getPos().x,
+	    legs[i].getPos().y, legs[j].getPos().x, legs[j].getPos().y);
+	ma_people.markers.push_back(getOvalMarkerForTwoPoints(id, legs[i].getPos().x,
+	    legs[i].getPos().y, legs[j].getPos().x, legs[j].getPos().y, getPeopleMarkerNextId()));
+	std::map<int, Person>::iterator it = persons.find(id);
+	if (it != persons.end()) { checkIfLeftOrRight(i, j, it->second.getGait()); }
+	publish_person_msg_stamped(id, getLegMsg(legs[i]), getLegMsg(legs[j]), header);
       }
     }
 
@@ -1189,13 +1530,45 @@ void LegDetector::init()
   }
 
 
-  bool LegDetector::clustering(const PointCloud& cloud, PointCloud& cluster_centroids)
+  Point LegDetector::getClusterCenter(const PointCloud& cloud, const std::vector<int>& indices)
+  {
+    ClusterMoments m;
+    computeClusterMoments(cloud, indices, m);
+    return getClusterCenter(cloud, indices, m);
+  }
+
+  Point LegDetector::getClusterCenter(const PointCloud& cloud, const std::vector<int>& indices, 
+				      const ClusterMoments& m)
+  {
+    Point p; p.x = m.mean_x; p.y = m.mean_y;
+    if (circle_fitting == "centroid") { return p; }
+    
+    double cx, cy, r;
+    bool fitted = false;
+    if (circle_fitting == "kasa") { fitted = fitCircleKasa(m, cx, cy, r); }
+    else if (circle_fitting == "taubin") { fitted = fitCircleTaubin(m, cx, cy, r); }
+    else if (circle_fitting == "ransac") 
+    { 
+      fitted = fitCircleRansac(cloud, indices, ransac_dist_threshold, ransac_max_iterations, 
+	0.5 * leg_radius, 2. * leg_radius, cx, cy, r); 
+    }
+    
+    // flat or noisy arcs give far away centres, keep the centroid for them
+    if (!fitted || r < 0.5 * leg_radius || r > 2. * leg_radius || 
+      distanceBtwTwoPoints(p.x, p.y, cx, cy) > 2. * leg_radius) 
+    { 
+      return p; 
+    }
+    p.x = cx; p.y = cy;
+    return p;
+  }
+
+  bool LegDetector::extractClusters(const PointCloud& cloud, std::vector<pcl::PointIndices>& cluster_indices)
   {
     if (cloud.points.size() < minClusterSize) { ROS_DEBUG("Clustering: Too small number of points!"); return false; }
 
     pcl::search::KdTree<Point>::Ptr tree (new pcl::search::KdTree<Point>);
     tree->setInputCloud (cloud.makeShared());
-    std::vector<pcl::PointIndices> cluster_indices;
     pcl::EuclideanClusterExtraction<Point> ec;
     ec.setClusterTolerance (clusterTolerance); 
     ec.setMinClusterSize (minClusterSize);
@@ -1203,167 +1576,235 @@ void LegDetector::init()
     ec.setSearchMethod(tree);
     ec.setInputCloud(cloud.makeShared());
     ec.extract(cluster_indices);
+    return true;
+  }
+
+  bool LegDetector::clustering(const PointCloud& cloud, PointCloud& cluster_centroids)
+  {
+    std::vector<pcl::PointIndices> cluster_indices;
+    if (!extractClusters(cloud, cluster_indices)) { return false; }
 
     cluster_centroids.header = cloud.header;
     cluster_centroids.points.clear();
     
-    PointCloud cluster_centroids_temp, leg_positions;
-    cluster_centroids_temp.header = cloud.header;
-    leg_positions.header = cloud.header;
-    
-    std::vector<std::pair<Point, Point> > minMaxPoints;
-    
-    for (Leg& l : legs) 
+    if (cluster_indices.size() != 0 && cloud.points.size() > 2)
     {
-      if (l.getPeopleId() != -1)
-      {
-	leg_positions.points.push_back(l.getPos());
-      }
+      pubExtendedLine(0., 0., cloud.points[0].x, cloud.points[0].y, 0);
+      pubExtendedLine(0., 0., cloud.points[cloud.points.size() - 1].x, cloud.points[cloud.points.size() - 1].y, 1);
     }
-    pcl::KdTreeFLANN<Point> kdtree_clusters, kdtree_legs;
     
-    if (leg_positions.points.size() != 0) {
-      kdtree_legs.setInputCloud(leg_positions.makeShared());
-    }
+    collectLegSeeds();
 
     for (std::vector<pcl::PointIndices>::const_iterator it = cluster_indices.begin(); it != cluster_indices.end(); ++it)
     {
-      pcl::PointCloud<Point>::Ptr cloud_cluster (new pcl::PointCloud<Point>);
-      cloud_cluster->header = cloud.header;
-      for (std::vector<int>::const_iterator pit = it->indices.begin (); pit != it->indices.end (); ++pit)
-	cloud_cluster->points.push_back (cloud.points[*pit]); //*
-      cloud_cluster->width = cloud_cluster->points.size();
-      cloud_cluster->height = 1;
-      cloud_cluster->is_dense = true;
-      
-      if (cloud.points.size() > 2)
-      {
-	pubExtendedLine(0., 0., cloud.points[0].x, cloud.points[0].y, 0);
-	pubExtendedLine(0., 0., cloud.points[cloud.points.size() - 1].x, cloud.points[cloud.points.size() - 1].y, 1);
-      }
-      
-      Point min, max;
-      pcl::getMinMax3D(*cloud_cluster, min, max);
-      min.x -= cluster_bounding_box_uncertainty;
-      min.y -= cluster_bounding_box_uncertainty; 
-      max.x += cluster_bounding_box_uncertainty; 
-      max.y += cluster_bounding_box_uncertainty; 
-      minMaxPoints.push_back(std::make_pair(min, max));
-      
-      Eigen::Vector4f centroid;
-      pcl::compute3DCentroid(*cloud_cluster, centroid);
-      
-      Point p; p.x = centroid(0); p.y = centroid(1);
-      
-      
-      if (leg_positions.points.size() != 0) {
-	std::vector<int> pointIdxRadius;
-	std::vector<float> pointsSquaredDistRadius;
-	// radius search
-	int count = kdtree_legs.radiusSearch(p, 0.03, pointIdxRadius, 
-							  pointsSquaredDistRadius);
-	if (count == 1) {
-	  cluster_centroids_temp.points.push_back(leg_positions.points[pointIdxRadius[0]]);
-	} else {
-	  cluster_centroids_temp.points.push_back(p);
-	}
-      } else {
-	cluster_centroids.points.push_back(p);
-      }
+      ClusterMoments m;
+      computeClusterMoments(cloud, it->indices, m);
+      addClusterCenters(cloud, it->indices, m, cluster_centroids);
     }
     
-    if (cluster_centroids_temp.points.size() == 0) { return true; }
+    reportClassification();
+    return true;
+  }
+
+  bool LegDetector::scanOrderClustering(const sensor_msgs::LaserScan& scan, PointCloud& cluster_centroids)
+  {
+    SensorPose sensor;
+    if (!lookupSensorPose(transform_link, scan.header.frame_id, sensor)) { return false; }
+    // cached end points are only valid for the pose of the sensor they were projected from
+    if (sensorMoved(segmenter_pose, sensor))
+    {
+      scan_segmenter.reset();
+      segmenter_pose = sensor;
+    }
+    scan_segmenter.segment(scan.ranges, scan.angle_min, scan.angle_increment, scan.range_min, scan.range_max, 
+			   sensor.x, sensor.y, sensor.yaw);
+    frame_stats.reprocessed_fraction = scan_segmenter.getReprocessedFraction();
     
-    kdtree_clusters.setInputCloud(cluster_centroids_temp.makeShared());
+    pcl_conversions::toPCL(scan.header, cluster_centroids.header);
+    cluster_centroids.header.frame_id = transform_link;
+    cluster_centroids.points.clear();
     
-    double radius = 0.2;
+    double x_min = isOnePersonToTrack ? x_lower_limit_dynamic : x_lower_limit;
+    double x_max = isOnePersonToTrack ? x_upper_limit_dynamic : x_upper_limit;
+    double y_min = isOnePersonToTrack ? y_lower_limit_dynamic : y_lower_limit;
+    double y_max = isOnePersonToTrack ? y_upper_limit_dynamic : y_upper_limit;
     
-    std::map<int, bool> map_removed_indices;
+    collectLegSeeds();
     
-    for (int i = 0; i < cluster_centroids_temp.points.size(); i++)
+    const PointCloud& points = scan_segmenter.getPoints();
+    const std::vector<ScanSegmenter<Point>::Segment>& segments = scan_segmenter.getSegments();
+    std::vector<int> indices;
+    for (int k = 0; k < segments.size(); k++)
     {
-      std::map<int, bool>::iterator removed_indices_it = map_removed_indices.find(i);
-      if (removed_indices_it != map_removed_indices.end()) { continue; }
-      
-      Point cluster = cluster_centroids_temp.points[i];
-      std::vector<int> pointIdxRadius_clusters, pointIdxRadius_legs;
-      std::vector<float> pointsSquaredDistRadius_clusters, pointsSquaredDistRadius_legs;
-      
-      int K = 2;
-      std::vector<int> pointsIdx(K);
-      std::vector<float> pointsSquaredDist(K);
-      
-//       radius search
-      int count_clusters = kdtree_clusters.radiusSearch(cluster, radius, pointIdxRadius_clusters, 
-							pointsSquaredDistRadius_clusters);
-      
-      int count_legs = kdtree_legs.nearestKSearch(cluster, K, pointsIdx, pointsSquaredDist);
-      
-      if (pointsIdx.size() != K) { 
-	cluster_centroids.points.push_back(cluster); 
-	continue; 
-      }
-      
-      Point fst_leg, snd_leg;
-      fst_leg = leg_positions[pointsIdx[0]];
-      snd_leg = leg_positions[pointsIdx[1]];
-      bool isFstPointInBox = (fst_leg.x >= minMaxPoints[i].first.x) && (fst_leg.y >= minMaxPoints[i].first.y)
-	&& (fst_leg.x <= minMaxPoints[i].second.x) && (fst_leg.y <= minMaxPoints[i].second.y);
-      bool isSndPointInBox = (snd_leg.x >= minMaxPoints[i].first.x) && (snd_leg.y >= minMaxPoints[i].first.y)
-	&& (snd_leg.x <= minMaxPoints[i].second.x) && (snd_leg.y <= minMaxPoints[i].second.y);
-      
-      if (isFstPointInBox && isSndPointInBox)
-      { 
-	
-	std::vector<pcl::PointIndices>::const_iterator it = cluster_indices.begin();
-	it += i;
-	
-	PointCloud fst, snd;
-	fst.header = cloud.header;
-	snd.header = cloud.header;
-	for (std::vector<int>::const_iterator pit = it->indices.begin(); pit != it->indices.end(); ++pit)
-	{ 
-	  Point p = cloud.points[*pit];
-	  double dot_product = p.x * cluster.y - cluster.x * p.y;
-	  if (dot_product < 0) { fst.points.push_back(p); }
-	  else { snd.points.push_back(p); }
-	}
-	
-	if (fst.points.size() < minClusterSize || snd.points.size() < minClusterSize) 
-	{
-	  cluster_centroids.points.push_back(cluster);
-	  continue;
-	}
-	
-	Eigen::Vector4f centroid_fst, centroid_snd;
-	pcl::compute3DCentroid(fst, centroid_fst);
-	pcl::compute3DCentroid(snd, centroid_snd);
-	
-	Point p_fst, p_snd;
-	p_fst.x = centroid_fst(0); p_fst.y = centroid_fst(1);
-	p_snd.x = centroid_snd(0); p_snd.y = centroid_snd(1);
-	
-	
-	if (distanceBtwTwoPoints(p_fst, p_snd) < leg_radius) 
-	{
-	  cluster_centroids.points.push_back(cluster);
-	  continue;
-	}
-	
-	cluster_centroids.points.push_back(p_fst);
-	cluster_centroids.points.push_back(p_snd);
-      }
-      else
-      {
-	cluster_centroids.points.push_back(cluster);
-      }
+      const ScanSegmenter<Point>::Segment& segment = segments[k];
+      if (!scan_segmenter.hasValidSize(segment)) { continue; }
+      const ClusterMoments& m = segment.moments;
+      if (m.mean_x < x_min || m.mean_x > x_max || m.mean_y < y_min || m.mean_y > y_max) { continue; }
+      indices.clear();
+      for (int i = segment.start; i <= segment.end; i++) { indices.push_back(i); }
+      addClusterCenters(points, indices, m, cluster_centroids);
     }
+    
+    reportClassification();
     return true;
   }
-  
-  
-  
-  void LegDetector::pub_bounding_box(double min_x, double min_y, double max_x, double max_y)
+
+  void LegDetector::collectLegSeeds()
+  {
+    // legs of people predicted to the time of this scan, they seed the split of merged clusters
+    leg_positions.clear();
+    predicted_leg_positions.clear();
+    for (Leg& l : legs) 
+    {
+      if (l.getPeopleId() == -1) { continue; }
+      Point p = l.getPos();
+      leg_positions.push_back(p);
+      p.x += scan_period * l.getVel().x;
+      p.y += scan_period * l.getVel().y;
+      predicted_leg_positions.push_back(p);
+    }
+    classified_clusters = rejected_clusters = 0;
+    classification_time = 0.;
+  }
+
+  void LegDetector::reportClassification()
+  {
+    if (classified_clusters != 0)
+    {
+      ROS_DEBUG("Cluster classifier: %d of %d clusters rejected, %f us per cluster", 
+		rejected_clusters, classified_clusters, 1e6 * classification_time / classified_clusters);
+    }
+  }
+
+  void LegDetector::addClusterCenters(const PointCloud& cloud, const std::vector<int>& indices, 
+				      const ClusterMoments& m, PointCloud& cluster_centroids)
+  {
+    double min_x = cloud.points[indices[0]].x, max_x = min_x;
+    double min_y = cloud.points[indices[0]].y, max_y = min_y;
+    for (int k = 1; k < indices.size(); k++)
+    {
+      min_x = std::min(min_x, (double) cloud.points[indices[k]].x);
+      max_x = std::max(max_x, (double) cloud.points[indices[k]].x);
+      min_y = std::min(min_y, (double) cloud.points[indices[k]].y);
+      max_y = std::max(max_y, (double) cloud.points[indices[k]].y);
+    }
+    min_x -= cluster_bounding_box_uncertainty;
+    min_y -= cluster_bounding_box_uncertainty; 
+    max_x += cluster_bounding_box_uncertainty; 
+    max_y += cluster_bounding_box_uncertainty; 
+    
+    std::vector<Point> seeds;
+    for (Point& p : predicted_leg_positions)
+    {
+      if (p.x >= min_x && p.y >= min_y && p.x <= max_x && p.y <= max_y) { seeds.push_back(p); }
+    }
+    
+    // over the time budget the rest of the frame is processed without splitting and far clusters
+    bool over_budget = isClusteringOverBudget();
+    if (over_budget && std::sqrt(m.mean_x * m.mean_x + m.mean_y * m.mean_y) > clustering_far_range) { return; }
+    
+    // several legs in one cluster, e.g. two people standing close to each other
+    if (seeds.size() >= 2 && frame_stats.degradation_level < leg_tracker::FrameStats::NO_SPLITTING && 
+      splitCluster(cloud, indices, seeds, cluster_centroids)) 
+    { 
+      return; 
+    }
+    
+    // clusters away from tracked legs, e.g. table legs or door frames, are dropped before they become tracks
+    if (seeds.empty() && cluster_classifier.isLoaded())
+    {
+      ros::WallTime start = ros::WallTime::now();
+      ClusterFeatures f;
+      computeClusterFeatures(cloud, indices, m, f);
+      bool is_leg = cluster_classifier.isLeg(f);
+      classification_time += (ros::WallTime::now() - start).toSec();
+      classified_clusters++;
+      if (!is_leg) { rejected_clusters++; return; }
+    }
+    
+    Point p = getClusterCenter(cloud, indices, m);
+    
+    int count = 0;
+    Point leg_position;
+    for (Point& l : leg_positions)
+    {
+      if (distanceBtwTwoPoints(p, l) <= 0.03) { leg_position = l; count++; }
+    }
+    if (count == 1) { p = leg_position; }
+    cluster_centroids.points.push_back(p);
+  }
+
+  bool LegDetector::splitCluster(const PointCloud& cloud, const std::vector<int>& indices, 
+				 std::vector<Point> seeds, PointCloud& cluster_centroids)
+  {
+    std::vector<int> labels(indices.size(), -1);
+    while (seeds.size() >= 2)
+    {
+      int k = seeds.size();
+      std::vector<int> counts(k, 0);
+      for (int iter = 0; iter < cluster_split_iterations; iter++)
+      {
+	bool changed = false;
+	std::vector<double> sum_x(k, 0.), sum_y(k, 0.);
+	std::fill(counts.begin(), counts.end(), 0);
+	for (int n = 0; n < indices.size(); n++)
+	{
+	  const Point& p = cloud.points[indices[n]];
+	  int nearest = 0;
+	  double min_dist = std::numeric_limits<double>::max();
+	  for (int c = 0; c < k; c++)
+	  {
+	    double dist = std::pow(p.x - seeds[c].x, 2) + std::pow(p.y - seeds[c].y, 2);
+	    if (dist < min_dist) { min_dist = dist; nearest = c; }
+	  }
+	  if (labels[n] != nearest) { labels[n] = nearest; changed = true; }
+	  sum_x[nearest] += p.x;
+	  sum_y[nearest] += p.y;
+	  counts[nearest]++;
+	}
+	for (int c = 0; c < k; c++)
+	{
+	  if (counts[c] == 0) { continue; }
+	  seeds[c].x = sum_x[c] / counts[c];
+	  seeds[c].y = sum_y[c] / counts[c];
+	}
+	if (!changed) { break; }
+      }
+      
+      // a part that is too small or too close to another one is no leg, its seed is dropped
+      int weakest = -1;
+      for (int c = 0; c < k; c++)
+      {
+	if (counts[c] < minClusterSize && (weakest == -1 || counts[c] < counts[weakest])) { weakest = c; }
+      }
+      for (int c = 0; c < k && weakest == -1; c++)
+      {
+	for (int d = c + 1; d < k; d++)
+	{
+	  if (distanceBtwTwoPoints(seeds[c], seeds[d]) < leg_radius)
+	  {
+	    weakest = counts[c] < counts[d] ? c : d;
+	    break;
+	  }
+	}
+      }
+      
+      if (weakest == -1)
+      {
+	std::vector<std::vector<int> > parts(k);
+	for (int n = 0; n < indices.size(); n++) { parts[labels[n]].push_back(indices[n]); }
+	for (int c = 0; c < k; c++) { cluster_centroids.points.push_back(getClusterCenter(cloud, parts[c])); }
+	return true;
+      }
+      seeds.erase(seeds.begin() + weakest);
+      std::fill(labels.begin(), labels.end(), -1);
+    }
+    return false;
+  }
+  
+  
+  
+  void LegDetector::pub_bounding_box(double min_x, double min_y, double max_x, double max_y)
   {	
     visualization_msgs::Marker marker;
     marker.header.frame_id = transform_link;
@@ -1403,65 +1844,223 @@ void LegDetector::init()
   }
   
 
+  void LegDetector::maskBeamsOutsideAttention(sensor_msgs::LaserScan& scan)
+  {
+    // every attention_full_scan_every frame the whole scan is processed to catch new people
+    attention_frame++;
+    if (legs.size() == 0 || attention_full_scan_every <= 1 || attention_frame % attention_full_scan_every == 0) { return; }
+    
+    SensorPose sensor;
+    if (!lookupSensorPose(transform_link, scan.header.frame_id, sensor)) { return; }
+    if (scan.angle_increment == 0.) { return; }
+    
+    int n = scan.ranges.size();
+    std::vector<char> keep(n, 0);
+    
+    // polar window around the predicted position of every leg, as wide as its gate
+    for (Leg& l : legs)
+    {
+      double x = l.getPos().x + scan_period * l.getVel().x - sensor.x;
+      double y = l.getPos().y + scan_period * l.getVel().y - sensor.y;
+      const Cov2d& S = l.getInnovationCov();
+      double radius = std::min(mahalanobis_dist_gate * std::sqrt(std::max(S(0, 0), S(1, 1))), 0.6) + leg_radius;
+      double range = std::sqrt(x * x + y * y);
+      // bearing in the scan, wrapped around the middle of the scan so that the beam indices stay in order
+      double scan_middle = scan.angle_min + 0.5 * (n - 1) * scan.angle_increment;
+      double bearing = std::atan2(y, x) - sensor.yaw - scan_middle;
+      bearing = scan_middle + std::atan2(std::sin(bearing), std::cos(bearing));
+      double half_width = range > radius ? std::asin(radius / range) : M_PI;
+      int fst = std::max(0, int(std::floor((bearing - half_width - scan.angle_min) / scan.angle_increment)));
+      int lst = std::min(n - 1, int(std::ceil((bearing + half_width - scan.angle_min) / scan.angle_increment)));
+      if (half_width >= M_PI) { fst = 0; lst = n - 1; }
+      for (int i = fst; i <= lst; i++)
+      {
+	if (scan.ranges[i] >= range - radius && scan.ranges[i] <= range + radius) { keep[i] = 1; }
+      }
+    }
+    
+    double x_min = isOnePersonToTrack ? x_lower_limit_dynamic : x_lower_limit;
+    double x_max = isOnePersonToTrack ? x_upper_limit_dynamic : x_upper_limit;
+    double y_min = isOnePersonToTrack ? y_lower_limit_dynamic : y_lower_limit;
+    double y_max = isOnePersonToTrack ? y_upper_limit_dynamic : y_upper_limit;
+    for (int i = 0; i < n; i++)
+    {
+      if (keep[i]) { continue; }
+      float r = scan.ranges[i];
+      if (!(r >= scan.range_min && r <= scan.range_max)) { continue; }
+      // entry band along the border of the tracking area
+      double angle = sensor.yaw + scan.angle_min + i * scan.angle_increment;
+      double x = sensor.x + r * std::cos(angle);
+      double y = sensor.y + r * std::sin(angle);
+      double border_dist = std::min(std::min(x - x_min, x_max - x), std::min(y - y_min, y_max - y));
+      if (border_dist > attention_entry_band) 
+      { 
+	scan.ranges[i] = std::numeric_limits<float>::quiet_NaN(); 
+      }
+    }
+  }
+
+  bool LegDetector::isSceneIdle(const sensor_msgs::LaserScan& scan)
+  {
+    if (!idle_gate) { return false; }
+    
+    int changed_beams = scan.ranges.size();
+    if (reference_ranges.size() == scan.ranges.size())
+    {
+      changed_beams = 0;
+      const float* ranges = scan.ranges.data();
+      const float* reference = reference_ranges.data();
+      float tolerance = idle_range_tolerance;
+      for (int i = 0; i < scan.ranges.size(); i++)
+      {
+	// a beam that gets or loses a return changed too, the difference is NaN then
+	changed_beams += std::isfinite(ranges[i]) != std::isfinite(reference[i]) || 
+	  std::fabs(ranges[i] - reference[i]) > tolerance;
+      }
+    }
+    
+    // live tracks have to be updated, no matter how little the scan changed
+    bool is_idle = changed_beams <= idle_changed_beams && legs.size() == 0;
+    if (is_idle != idle) 
+    { 
+      ROS_DEBUG("Idle gate: %s, %d beams changed", is_idle ? "idle" : "processing", changed_beams); 
+    }
+    idle = is_idle;
+    // the reference is the last processed scan, so that slow changes add up
+    if (!idle) { reference_ranges = scan.ranges; }
+    return idle;
+  }
+
+  void LegDetector::predictLeg(Leg& l)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    l.predict(current_stamp.toSec());
+    frame_stats.filter_time += (ros::WallTime::now() - start).toSec();
+  }
+
+  void LegDetector::updateLeg(Leg& l, const Point& p)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    l.update(p);
+    frame_stats.filter_time += (ros::WallTime::now() - start).toSec();
+  }
+
+  bool LegDetector::isLegInView(Leg& l)
+  {
+    if (!view_sensor || !view_sensor->pose.valid) { return true; }
+    const SensorPose& pose = view_sensor->pose;
+    double x = l.getPos().x - pose.x;
+    double y = l.getPos().y - pose.y;
+    double range = std::sqrt(x * x + y * y);
+    if (range < view_sensor->range_min || range > view_sensor->range_max) { return false; }
+    double scan_middle = 0.5 * (view_sensor->angle_min + view_sensor->angle_max);
+    double bearing = std::atan2(y, x) - pose.yaw - scan_middle;
+    bearing = scan_middle + std::atan2(std::sin(bearing), std::cos(bearing));
+    return bearing >= view_sensor->angle_min && bearing <= view_sensor->angle_max;
+  }
+
+  // a leg is missed by a scan only if the scanner can see it, with several scanners
+  // the others would reset its observations before it is seen again
+  void LegDetector::missLeg(Leg& l)
+  {
+    l.missed(isLegInView(l));
+  }
+
+  void LegDetector::setSensorView(ScanSensor& sensor, const sensor_msgs::LaserScan& scan)
+  {
+    sensor.angle_min = scan.angle_min;
+    sensor.angle_max = scan.angle_max;
+    sensor.range_min = scan.range_min;
+    sensor.range_max = scan.range_max;
+    if (!lookupSensorPose(transform_link, scan.header.frame_id, sensor.pose)) { sensor.pose.valid = false; }
+  }
+
   void LegDetector::predictLegs()
   {
     for (int i = 0; i < legs.size(); i++) {
-      legs[i].predict(); 
-      legs[i].missed();
+      predictLeg(legs[i]); 
+      missLeg(legs[i]);
     }
     if (!isOnePersonToTrack)
     {
-      cullDeadTracks(legs);
+      cullDeadTracks();
     }
   }
 
-  void LegDetector::removeLegFromVector(std::vector<Leg>& v, unsigned int i)
+  void LegDetector::removeLeg(unsigned int i)
   {
-    // save people id at v[i] 
-    if (v[i].getPeopleId() != -1 && !v[i].hasPair()) 
+    // save people id at legs[i] 
+    if (legs[i].getPeopleId() != -1 && !legs[i].hasPair()) 
     {
-      for (int j = 0; j < removed_legs.size(); j++) 
+      const Tombstone* removed_leg = lost_legs.find(legs[i].getPeopleId());
+      if (removed_leg != NULL) 
       {
-	if (removed_legs[j].getPeopleId() != v[i].getPeopleId()) { continue; }
-	
 	Point peoplePos;
-	peoplePos.x = (v[i].getPos().x + removed_legs[j].getPos().x) / 2;
-	peoplePos.y = (v[i].getPos().y + removed_legs[j].getPos().y) / 2;
+	peoplePos.x = (legs[i].getPos().x + removed_leg->x) / 2;
+	peoplePos.y = (legs[i].getPos().y + removed_leg->y) / 2;
 	
-	lastSeenPeoplePositions.push_back(std::make_tuple(0, v[i].getPeopleId(), peoplePos));
+	Tombstone t = getTombstone(legs[i], peoplePos.x, peoplePos.y, 
+	  isPointNearToLimits(peoplePos) ? lost_people_timeout_near_limits : lost_people_timeout);
+	t.vel_x = (t.vel_x + removed_leg->vel_x) / 2;
+	t.vel_y = (t.vel_y + removed_leg->vel_y) / 2;
+	lost_legs.erase(legs[i].getPeopleId());
+	lost_people.insert(t);
       }
     }
-      
-    if (i != v.size() - 1) {
-      Leg l = v[v.size() - 1];
-      v[i] = l;
+    
+    track_index.erase(legs[i].getHandle());
+    if (i != legs.size() - 1) {
+      legs[i] = legs[legs.size() - 1];
+      track_index.setIndex(legs[i].getHandle(), i);
     }
-    v.pop_back();
+    legs.pop_back();
   }
 
-  void LegDetector::resetHasPair(std::vector<Leg>& v, int fst_leg)
+  void LegDetector::resetHasPair(int fst_leg)
   {
-    for (int snd_leg = 0; snd_leg < v.size(); snd_leg++) {
-      if (snd_leg != fst_leg && v[snd_leg].getPeopleId() == v[fst_leg].getPeopleId()) {
-	v[snd_leg].setHasPair(false);
-	break;
-      }
+    int snd_leg = track_index.getPartnerIndex(legs[fst_leg].getHandle());
+    if (snd_leg != -1) 
+    {
+      legs[snd_leg].setHasPair(false);
     }
   }
 
-  void LegDetector::cullDeadTracks(std::vector<Leg>& v)
+  void LegDetector::cullDeadTracks()
   {
     int i = 0;
-    while(i < v.size()) {
-      if (v[i].is_dead()) {
-	if (v[i].hasPair()) { resetHasPair(v, i); removed_legs.push_back(v[i]); }
-	removeLegFromVector(v, i);
+    while(i < legs.size()) {
+      if (legs[i].is_dead()) {
+	if (legs[i].hasPair()) 
+	{ 
+	  resetHasPair(i);
+	  lost_legs.insert(getTombstone(legs[i], legs[i].getPos().x, legs[i].getPos().y, lost_people_timeout));
+	}
+	removeLeg(i);
       } else {
 	i++;
       }
     }			
   }
 
+  void LegDetector::reindexLegs()
+  {
+    for (int i = 0; i < legs.size(); i++)
+    {
+      track_index.setIndex(legs[i].getHandle(), i);
+    }
+  }
+
+  void LegDetector::setLegPeopleId(int i, int id)
+  {
+    int evicted = track_index.setPeopleId(legs[i].getHandle(), id);
+    legs[i].setPeopleId(id);
+    if (evicted >= 0 && evicted < (int) legs.size())
+    {
+      legs[evicted].setPeopleId(-1);
+      legs[evicted].setHasPair(false);
+    }
+  }
+
   unsigned int LegDetector::getNextCovEllipseId()
   {
     return cov_ellipse_id++;
@@ -1469,28 +2068,18 @@ void LegDetector::init()
   
   void LegDetector::boundingBoxTracking(PointCloud& cluster_centroids)
   {
-    std::map<int, int> id_to_index_map;
-    
     for (int i = 0; i < legs.size(); i++)
     {
       if (!legs[i].is_dead()) {
-	legs[i].predict();
+	predictLeg(legs[i]);
       }
-      id_to_index_map.insert(std::make_pair(legs[i].getLegId(), i));
     }
     
-    
-    std::map<int, int>::iterator it;
     for (int j = 0; j < tracking_zones.size(); j++) 
     {
-      int fst_leg = -1, snd_leg = -1;
-      it = id_to_index_map.find(tracking_zones[j].getFstLegId());
-      if (it != id_to_index_map.end()) { fst_leg = it->second; }
-      else { ROS_ERROR("Could not find index for leg id!"); continue; }
-      it = id_to_index_map.find(tracking_zones[j].getSndLegId());
-      if (it != id_to_index_map.end()) { snd_leg = it->second; }
-      else { ROS_ERROR("Could not find index for leg id!"); continue; }
-      if (fst_leg == -1 || snd_leg == -1) { continue; }
+      int fst_leg = track_index.getIndexOfLeg(tracking_zones[j].getFstLegId());
+      int snd_leg = track_index.getIndexOfLeg(tracking_zones[j].getSndLegId());
+      if (fst_leg == -1 || snd_leg == -1) { ROS_ERROR("Could not find index for leg id!"); continue; }
       
       
       tracking_zones[j].update(legs[fst_leg].getPos().x, legs[fst_leg].getPos().y, legs[snd_leg].getPos().x, legs[snd_leg].getPos().y);
@@ -1498,39 +2087,28 @@ void LegDetector::init()
     
     if (cluster_centroids.points.size() == 0) { return; }
     
-    std::map<int, bool> usedPointsIds;
-    
-    for (int i = 0; i < tracking_zones.size(); i++)
-    {
-      PointCloud used_points_cloud;
-      used_points_cloud.header = cluster_centroids.header;
-      std::map<int, bool>::iterator it;
-      for (int j = 0; j < cluster_centroids.points.size(); j++) 
-      {
-	it = usedPointsIds.find(j);
-	if (it != usedPointsIds.end()) { continue; } // "it != end" means that the point is used
-	if (cluster_centroids.points[j].x >= tracking_zones[i].getXLowerLimit() &&
-	    cluster_centroids.points[j].x <= tracking_zones[i].getXUpperLimit() &&
-	    cluster_centroids.points[j].y >= tracking_zones[i].getYLowerLimit() &&
-	    cluster_centroids.points[j].y <= tracking_zones[i].getYUpperLimit())
-	{
-	  usedPointsIds.insert(std::make_pair(j, true));
-	  used_points_cloud.points.push_back(cluster_centroids.points[j]);
-	}
-      }
-      matchClusterCentroids2Legs(tracking_zones[i].getFstLegId(), tracking_zones[i].getSndLegId(), used_points_cloud, i);
-    }
-    
+    // bin every centroid to the first tracking zone containing it in one pass
+    zone_grid.build(tracking_zones, max_dist_btw_legs);
+    std::vector<PointCloud> zone_points(tracking_zones.size());
     PointCloud rest_points;
     rest_points.header = cluster_centroids.header;
     for (int j = 0; j < cluster_centroids.points.size(); j++) 
     {
-      std::map<int, bool>::iterator it;
-      it = usedPointsIds.find(j);
-      if (it == usedPointsIds.end()) // j is not in the map
+      int zone = zone_grid.findZone(cluster_centroids.points[j].x, cluster_centroids.points[j].y, tracking_zones);
+      if (zone == -1) 
       { 
 	rest_points.points.push_back(cluster_centroids.points[j]);
       }
+      else
+      {
+	zone_points[zone].points.push_back(cluster_centroids.points[j]);
+      }
+    }
+    
+    for (int i = 0; i < tracking_zones.size(); i++)
+    {
+      zone_points[i].header = cluster_centroids.header;
+      matchClusterCentroids2Legs(tracking_zones[i].getFstLegId(), tracking_zones[i].getSndLegId(), zone_points[i], i);
     }
     
     if (rest_points.points.size() == 0) { return; }
@@ -1551,23 +2129,20 @@ void LegDetector::init()
     
     assign_munkres(rest_points, legsWithoudPeopleId, fused);
     
-    cullDeadTracks(fused);
-    
     for (int i = 0; i < fused.size(); i++) 
     {
       legsWithPeopleId.push_back(fused[i]);
     }
     
     legs = legsWithPeopleId;
+    reindexLegs();
+    cullDeadTracks();
   }
   
   void LegDetector::matchClusterCentroids2Legs(unsigned int fst_leg_id, unsigned int snd_leg_id, PointCloud& cluster_centroids, int tracking_zone_index)
   {
-    int fst_leg = -1, snd_leg = -1;
-    for (int i = 0; i < legs.size(); i++) {
-      if (legs[i].getLegId() == fst_leg_id) { fst_leg = i; }
-      if (legs[i].getLegId() == snd_leg_id) { snd_leg = i; }
-    }
+    int fst_leg = track_index.getIndexOfLeg(fst_leg_id);
+    int snd_leg = track_index.getIndexOfLeg(snd_leg_id);
     if (fst_leg == -1 || snd_leg == -1 || cluster_centroids.points.size() == 0) 
     { 
       return; 
@@ -1577,13 +2152,8 @@ void LegDetector::init()
     {
       Point p = cluster_centroids.points[0];
       
-      double fst_cov = legs[fst_leg].getMeasToTrackMatchingCov();
-      double snd_cov = legs[snd_leg].getMeasToTrackMatchingCov();
-	     
-      double fst_mahalanobis_dist = std::sqrt((std::pow((p.x - legs[fst_leg].getPos().x), 2) +
-	  std::pow((p.y - legs[fst_leg].getPos().y), 2)) / fst_cov);
-      double snd_mahalanobis_dist = std::sqrt((std::pow((p.x - legs[snd_leg].getPos().x), 2) +
-	  std::pow((p.y - legs[snd_leg].getPos().y), 2)) / snd_cov);
+      double fst_mahalanobis_dist = legs[fst_leg].mahalanobisDist(p);
+      double snd_mahalanobis_dist = legs[snd_leg].mahalanobisDist(p);
       
       double fst_euclidian_dist = distanceBtwTwoPoints(p, legs[fst_leg].getPos());
       double snd_euclidian_dist = distanceBtwTwoPoints(p, legs[snd_leg].getPos());
@@ -1592,29 +2162,25 @@ void LegDetector::init()
       
       if (fst_mahalanobis_dist <= snd_mahalanobis_dist) 
       {
-	legs[fst_leg].update(p);
+	updateLeg(legs[fst_leg], p);
       }
       else
       {
-	legs[snd_leg].update(p);
+	updateLeg(legs[snd_leg], p);
       }
     } 
     else 
     {
       double total_cost = max_cost;
-      double fst_cov = legs[fst_leg].getMeasToTrackMatchingCov();
-      double snd_cov = legs[snd_leg].getMeasToTrackMatchingCov();
       int fst_index = -1, snd_index = -1;
       
       for (int i = 0; i < cluster_centroids.points.size(); i++) 
       {
-	double fst_cost = std::sqrt((std::pow((cluster_centroids.points[i].x - legs[fst_leg].getPos().x), 2) +
-	  std::pow((cluster_centroids.points[i].y - legs[fst_leg].getPos().y), 2)) / fst_cov);
+	double fst_cost = legs[fst_leg].mahalanobisDist(cluster_centroids.points[i]);
 	for (int j = 0; j < cluster_centroids.points.size(); j++) 
 	{
 	  if (i == j) { continue; }
-	  double snd_cost = std::sqrt((std::pow((cluster_centroids.points[j].x - legs[i].getPos().x), 2) +
-	    std::pow((cluster_centroids.points[j].y - legs[i].getPos().y), 2)) / snd_cov);
+	  double snd_cost = legs[snd_leg].mahalanobisDist(cluster_centroids.points[j]);
 	  if (fst_cost + snd_cost < total_cost) 
 	  {
 	    total_cost = fst_cost + snd_cost;
@@ -1629,14 +2195,14 @@ void LegDetector::init()
       double euclid_dist = distanceBtwTwoPoints(cluster_centroids.points[fst_index], legs[fst_leg].getPos());
       if (euclid_dist < 0.33) 
       {
-	legs[fst_leg].update(cluster_centroids.points[fst_index]);
+	updateLeg(legs[fst_leg], cluster_centroids.points[fst_index]);
       }
       
-      legs[snd_leg].update(cluster_centroids.points[snd_index]);
+      updateLeg(legs[snd_leg], cluster_centroids.points[snd_index]);
       euclid_dist = distanceBtwTwoPoints(cluster_centroids.points[snd_index], legs[snd_leg].getPos());
       if (euclid_dist < 0.33) 
       {
-	legs[snd_leg].update(cluster_centroids.points[snd_index]);
+	updateLeg(legs[snd_leg], cluster_centroids.points[snd_index]);
       }
     } 
     
@@ -1652,34 +2218,205 @@ void LegDetector::init()
     {	
       if (legs[i].hasPair()) {
 	double vel = calculateNorm(legs[i].getVel());
-	if (vel > 0.2) {
-	  for (int j = i + 1; j < legs.size(); j++) {
-	    if (legs[i].getPeopleId() == legs[j].getPeopleId()) {
-	      double dist = distanceBtwTwoPoints(legs[i].getPos(), legs[j].getPos());
-	      if (max_dist_btw_legs - dist < 0.1) {
-		legs[i].resetErrorCovAndState();
-	      }
-	      break;
-	    }
+	int j = track_index.getPartnerIndex(legs[i].getHandle());
+	if (vel > 0.2 && j > i) {
+	  double dist = distanceBtwTwoPoints(legs[i].getPos(), legs[j].getPos());
+	  if (max_dist_btw_legs - dist < 0.1) {
+	    legs[i].resetErrorCovAndState();
 	  }
 	}
       }
       
-      legs[i].predict();
+      predictLeg(legs[i]);
     }
     
     if (cluster_centroids.points.size() == 0) { return; }
     
     std::vector<Leg> fused;
 
-    assign_munkres(cluster_centroids, legs, fused);
+    if (person_gating && persons.size() != 0)
+    {
+      // legs of gated people are matched within their person, the rest goes to munkres
+      PointCloud rest_points;
+      rest_points.header = cluster_centroids.header;
+      std::vector<bool> handled(legs.size(), false);
+      personGating(cluster_centroids, rest_points, handled);
+      
+      std::vector<Leg> tracks;
+      for (int i = 0; i < legs.size(); i++)
+      {
+	if (handled[i]) { fused.push_back(legs[i]); }
+	else { tracks.push_back(legs[i]); }
+      }
+      if (rest_points.points.size() != 0 || tracks.size() != 0)
+      {
+	assign_munkres(rest_points, tracks, fused);
+      }
+    }
+    else
+    {
+      assign_munkres(cluster_centroids, legs, fused);
+    }
 
-    cullDeadTracks(fused);
-    
     legs = fused;
+    reindexLegs();
+    cullDeadTracks();
   }
 
   
+  void LegDetector::predictPersons()
+  {
+    for (std::map<int, Person>::iterator it = persons.begin(); it != persons.end(); it++)
+    {
+      it->second.predict(current_stamp.toSec());
+    }
+  }
+
+  void LegDetector::updatePersons()
+  {
+    for (int i = 0; i < legs.size(); i++)
+    {
+      if (!legs[i].hasPair()) { continue; }
+      int j = track_index.getPartnerIndex(legs[i].getHandle());
+      if (j <= i) { continue; }
+      
+      int id = legs[i].getPeopleId();
+      double x = (legs[i].getPos().x + legs[j].getPos().x) / 2;
+      double y = (legs[i].getPos().y + legs[j].getPos().y) / 2;
+      std::map<int, Person>::iterator it = persons.find(id);
+      if (it == persons.end())
+      {
+	persons.insert(std::make_pair(id, Person(id, legs[i].getHandle(), legs[j].getHandle(), x, y,
+	  current_stamp.toSec(), person_process_noise, person_measurement_noise)));
+      }
+      else
+      {
+	it->second.setLegs(legs[i].getHandle(), legs[j].getHandle());
+	// predicted legs carry no new information about the person
+	if (legs[i].getOccludedAge() == 0 || legs[j].getOccludedAge() == 0)
+	{
+	  it->second.update(x, y);
+	}
+      }
+    }
+    
+    std::map<int, Person>::iterator it = persons.begin();
+    while (it != persons.end())
+    {
+      std::pair<int, int> indices = track_index.getPeopleIndices(it->first);
+      if (indices.first == -1 && indices.second == -1) { persons.erase(it++); }
+      else { it++; }
+    }
+  }
+
+  double LegDetector::gatedLegCost(Leg& l, const Point& p)
+  {
+    double mahalanobis_dist = l.mahalanobisDist(p);
+    double dist = distanceBtwTwoPoints(p, l.getPos());
+    if (mahalanobis_dist < mahalanobis_dist_gate && 
+      ((dist < 0.45 && l.getObservations() == 0) || (dist < 0.35 && l.getObservations() > 0)))
+    {
+      return mahalanobis_dist;
+    }
+    return max_cost;
+  }
+
+  void LegDetector::personGating(const PointCloud& cluster_centroids, PointCloud& rest_points, 
+				 std::vector<bool>& handled)
+  {
+    double leg_spread_var = std::pow(max_dist_btw_legs / 2, 2);
+    
+    std::vector<Person*> gated_persons;
+    std::vector<std::pair<int, int> > person_legs;
+    for (std::map<int, Person>::iterator it = persons.begin(); it != persons.end(); it++)
+    {
+      int fst_leg = track_index.getIndex(it->second.getFstLeg());
+      int snd_leg = track_index.getIndex(it->second.getSndLeg());
+      if (fst_leg == -1 || snd_leg == -1) { continue; }
+      gated_persons.push_back(&it->second);
+      person_legs.push_back(std::make_pair(fst_leg, snd_leg));
+    }
+    
+    // every cluster goes to the person with the smallest gate distance
+    std::vector<PointCloud> person_points(gated_persons.size());
+    for (int j = 0; j < cluster_centroids.points.size(); j++)
+    {
+      const Point& p = cluster_centroids.points[j];
+      int best = -1;
+      double min_dist = person_gate;
+      for (int k = 0; k < gated_persons.size(); k++)
+      {
+	double dist = gated_persons[k]->gateDistanceSquared(p.x, p.y, leg_spread_var);
+	if (dist >= 0. && dist <= min_dist)
+	{
+	  min_dist = dist;
+	  best = k;
+	}
+      }
+      if (best == -1) { rest_points.points.push_back(p); }
+      else { person_points[best].points.push_back(p); }
+    }
+    
+    for (int k = 0; k < gated_persons.size(); k++)
+    {
+      if (person_points[k].points.size() == 0) { continue; }
+      assignClustersToPersonLegs(person_legs[k].first, person_legs[k].second, person_points[k], rest_points);
+      handled[person_legs[k].first] = true;
+      handled[person_legs[k].second] = true;
+    }
+  }
+
+  void LegDetector::assignClustersToPersonLegs(int fst_leg, int snd_leg, const PointCloud& clusters, 
+					       PointCloud& rest_points)
+  {
+    int n = clusters.points.size();
+    std::vector<double> fst_cost(n), snd_cost(n);
+    for (int k = 0; k < n; k++)
+    {
+      fst_cost[k] = gatedLegCost(legs[fst_leg], clusters.points[k]);
+      snd_cost[k] = gatedLegCost(legs[snd_leg], clusters.points[k]);
+    }
+    
+    // -1 stands for a missed leg
+    double miss_cost = mahalanobis_dist_gate;
+    double total_cost = 2 * miss_cost;
+    int fst_index = -1, snd_index = -1;
+    for (int a = -1; a < n; a++)
+    {
+      for (int b = -1; b < n; b++)
+      {
+	if (a == b && a != -1) { continue; }
+	double cost = (a == -1 ? miss_cost : fst_cost[a]) + (b == -1 ? miss_cost : snd_cost[b]);
+	if (cost < total_cost)
+	{
+	  total_cost = cost;
+	  fst_index = a;
+	  snd_index = b;
+	}
+      }
+    }
+    
+    if (fst_index != -1) { updateLeg(legs[fst_leg], clusters.points[fst_index]); }
+    else { missLeg(legs[fst_leg]); }
+    if (snd_index != -1) { updateLeg(legs[snd_leg], clusters.points[snd_index]); }
+    else { missLeg(legs[snd_leg]); }
+    
+    for (int k = 0; k < n; k++)
+    {
+      if (k != fst_index && k != snd_index) { rest_points.points.push_back(clusters.points[k]); }
+    }
+  }
+
+  double LegDetector::assignmentCost(Leg& l, const Point& p)
+  {
+    double dist = distanceBtwTwoPoints(p, l.getPos());
+    if (dist <= 0.03) { return 0; }
+    if (dist >= max_assignment_dist) { return max_cost; }
+    double mahalanobis_dist = l.mahalanobisDist(p);
+    if (mahalanobis_dist < mahalanobis_dist_gate) { return mahalanobis_dist; }
+    return max_cost;
+  }
+
   void LegDetector::assign_munkres(const PointCloud& meas,
 		    std::vector<Leg> &tracks,
 		    std::vector<Leg> &fused)
@@ -1688,108 +2425,129 @@ void LegDetector::init()
       int meas_count = meas.points.size();
       int tracks_count = tracks.size();
 
-      // Determine max of meas_count and tracks
-      int rows = -1, cols = -1;
-      if (meas_count >= tracks_count) {
-	  rows = cols = meas_count;
-      } else {
-	  rows = cols = tracks_count;
-      }
-      
-      Matrix<double> matrix(rows, cols);
-      
       visualization_msgs::MarkerArray cov_ellipse_ma;
       if (cov_ellipse_id != 0) {
 	removeOldMarkers(0, cov_ellipse_id, cov_marker_pub);
 	cov_ellipse_id = 0;
       }
 
-      // New measurements are along the Y-axis (left hand side)
-      // Previous tracks are along x-axis (top-side)
-      int r = 0;
-      for(const Point& p : meas.points) {
-	std::vector<Leg>::iterator it_prev = tracks.begin();
-	int c = 0;
-	for (; it_prev != tracks.end(); it_prev++, c++) {
-	  Eigen::MatrixXd cov_matrix = it_prev->getMeasToTrackMatchingCovMatrix();
-	  double cov = it_prev->getMeasToTrackMatchingCov();
-	  if (cov == 0) { ROS_ERROR("assign_munkres: cov = 0"); continue; }
-	  double mahalanobis_dist = std::sqrt((std::pow((p.x - it_prev->getPos().x), 2) +
-						std::pow((p.y - it_prev->getPos().y), 2)) / cov);
-	  double dist = distanceBtwTwoPoints(p, it_prev->getPos());
-// 	  cov_ellipse_ma.markers.push_back(getCovarianceEllipse(getNextCovEllipseId(), it_prev->getPos().x,
-// 	    it_prev->getPos().y, cov_matrix));
-	  
-	  if (dist <= 0.03)
-	  {
-	    matrix(r, c) = 0;
-	  } 
-	  else if (mahalanobis_dist < mahalanobis_dist_gate && dist < 0.6) 
-	  {
-	    matrix(r, c) = mahalanobis_dist;
-	  } 
-	  else 
-	  {
-	    matrix(r, c) = max_cost;
+      // track assigned to every measurement, -1 for none
+      std::vector<int> track_of_meas(meas_count, -1);
+      Munkres<double> m;
+      if (polar_gating)
+      {
+	// only pairs whose bearings overlap can be within the gate. Tracks and clusters linked by
+	// such pairs form independent assignment problems, each one is solved on its own matrix.
+	std::vector<BearingInterval> intervals;
+	for (int c = 0; c < tracks_count; c++) {
+	  addBearingInterval(tracks[c].getPos().x, tracks[c].getPos().y, max_assignment_dist, c, intervals);
+	}
+	std::vector<std::pair<double, int> > bearings;
+	for (int r = 0; r < meas_count; r++) {
+	  bearings.push_back(std::make_pair(std::atan2(meas.points[r].y, meas.points[r].x), r));
+	}
+	std::vector<std::pair<int, int> > pairs;
+	sweepBearingIntervals(intervals, bearings, pairs);
+	std::vector<int> meas_component, track_component;
+	int components = pairComponents(meas_count, tracks_count, pairs, meas_component, track_component);
+	std::vector<std::vector<int> > component_meas(components), component_tracks(components);
+	std::vector<int> local_meas(meas_count, -1);
+	for (int r = 0; r < meas_count; r++) {
+	  if (meas_component[r] == -1) { continue; }
+	  local_meas[r] = component_meas[meas_component[r]].size();
+	  component_meas[meas_component[r]].push_back(r);
+	}
+	std::vector<int> local_track(tracks_count, -1);
+	for (int c = 0; c < tracks_count; c++) {
+	  if (track_component[c] == -1) { continue; }
+	  local_track[c] = component_tracks[track_component[c]].size();
+	  component_tracks[track_component[c]].push_back(c);
+	}
+	std::vector<std::vector<std::pair<int, int> > > component_pairs(components);
+	for (int k = 0; k < pairs.size(); k++) {
+	  component_pairs[meas_component[pairs[k].first]].push_back(pairs[k]);
+	}
+	for (int k = 0; k < components; k++) {
+	  const std::vector<int>& rows = component_meas[k];
+	  const std::vector<int>& cols = component_tracks[k];
+	  if (rows.size() == 1 && cols.size() == 1) {
+	    track_of_meas[rows[0]] = cols[0];
+	    continue;
+	  }
+	  int size = std::max(rows.size(), cols.size());
+	  Matrix<double> matrix(size, size);
+	  for (int r = 0; r < size; r++) {
+	    for (int c = 0; c < size; c++) { matrix(r, c) = max_cost; }
+	  }
+	  for (const std::pair<int, int>& pair : component_pairs[k]) {
+	    matrix(local_meas[pair.first], local_track[pair.second]) = assignmentCost(tracks[pair.second], meas.points[pair.first]);
+	  }
+	  m.solve(matrix);
+	  for (int r = 0; r < rows.size(); r++) {
+	    for (int c = 0; c < cols.size(); c++) {
+	      if (matrix(r, c) == 0) { track_of_meas[rows[r]] = cols[c]; break; }
+	    }
+	  }
+	}
+      }
+      else
+      {
+	// New measurements are along the Y-axis (left hand side)
+	// Previous tracks are along x-axis (top-side)
+	int size = std::max(meas_count, tracks_count);
+	Matrix<double> matrix(size, size);
+	int r = 0;
+	for(const Point& p : meas.points) {
+	  std::vector<Leg>::iterator it_prev = tracks.begin();
+	  int c = 0;
+	  for (; it_prev != tracks.end(); it_prev++, c++) {
+// 	    cov_ellipse_ma.markers.push_back(getCovarianceEllipse(getNextCovEllipseId(), it_prev->getPos().x,
+// 	      it_prev->getPos().y, it_prev->getInnovationCov()));
+	    matrix(r, c) = assignmentCost(*it_prev, p);
+	  }
+	  r++;
+	}
+	m.solve(matrix);
+	for (r = 0; r < meas_count; r++) {
+	  for (int c = 0; c < tracks_count; c++) {
+	    if (matrix(r, c) == 0) { track_of_meas[r] = c; break; }
 	  }
 	}
-	r++;
       }
       
 //       cov_marker_pub.publish(cov_ellipse_ma);
       
-      Munkres<double> m;
-      m.solve(matrix);
-      
       // Use the assignment to update the old tracks with new blob measurement
-      int meas_it = 0;
-      for(r = 0; r < rows; r++) {
-	std::vector<Leg>::iterator it_prev = tracks.begin();
-	for (int c = 0; c < cols; c++) {
-	    if (matrix(r,c) == 0) {
-		if (r < meas_count && c < tracks_count) {
-		  double cov = it_prev->getMeasToTrackMatchingCov();
-		  double mahalanobis_dist = std::sqrt((std::pow((
-		    meas.points[meas_it].x - it_prev->getPos().x), 2) +
-		    std::pow((meas.points[meas_it].y - it_prev->getPos().y), 2)) / cov);
-		  double dist = distanceBtwTwoPoints(meas.points[meas_it], it_prev->getPos());
-		  
-		  if ((mahalanobis_dist < mahalanobis_dist_gate &&
-		  dist < 0.45 && it_prev->getObservations() == 0) ||
-		  (mahalanobis_dist < mahalanobis_dist_gate &&
-		  dist < 0.35 && it_prev->getObservations() > 0))
-		  {
-		      // Found an assignment. Update the new measurement
-		      // with the track ID and age of older track. Add
-		      // to fused list
-		      it_prev->update(meas.points[meas_it]);
-		      fused.push_back(*it_prev);
-		  } else {
-		      // TOO MUCH OF A JUMP IN POSITION
-		      // Probably a missed track or a new track
-		      it_prev->missed();
-		      fused.push_back(*it_prev);
-		      
-		      // And a new track
-		      fused.push_back(initLeg(meas.points[meas_it]));
-		  }
-		  
-		} else if (r >= meas_count) {
-		      it_prev->missed();
-		      fused.push_back(*it_prev);
-		} else if (c >= tracks_count) {
-		      // Possible new track
-		  fused.push_back(initLeg(meas.points[meas_it]));
-		}
-		break; // There is only one assignment per row
-	  }
-	  if (c < tracks_count-1) {
-	      it_prev++;
+      std::vector<char> updated(tracks_count, 0);
+      for (int r = 0; r < meas_count; r++) {
+	int c = track_of_meas[r];
+	if (c != -1) {
+	  double mahalanobis_dist = tracks[c].mahalanobisDist(meas.points[r]);
+	  double dist = distanceBtwTwoPoints(meas.points[r], tracks[c].getPos());
+	  
+	  if ((mahalanobis_dist < mahalanobis_dist_gate &&
+	  dist < 0.45 && tracks[c].getObservations() == 0) ||
+	  (mahalanobis_dist < mahalanobis_dist_gate &&
+	  dist < 0.35 && tracks[c].getObservations() > 0))
+	  {
+	      // Found an assignment. Update the new measurement
+	      // with the track ID and age of older track. Add
+	      // to fused list
+	      updateLeg(tracks[c], meas.points[r]);
+	      fused.push_back(tracks[c]);
+	      updated[c] = 1;
+	      continue;
 	  }
+	  // TOO MUCH OF A JUMP IN POSITION
+	  // Probably a missed track or a new track
 	}
-	if (r < meas_count-1) {
-	      meas_it++;
-	}
+	// Possible new track
+	fused.push_back(initLeg(meas.points[r]));
+      }
+      for (int c = 0; c < tracks_count; c++) {
+	if (updated[c]) { continue; }
+	missLeg(tracks[c]);
+	fused.push_back(tracks[c]);
       }
   }
 
@@ -1892,16 +2650,6 @@ void LegDetector::init()
     }
   }
   
-  void LegDetector::removeLastSeenPeoplePosition(int i)
-  {
-    if (i != lastSeenPeoplePositions.size() - 1)
-    {
-      std::tuple<unsigned int, unsigned int, Point> t = lastSeenPeoplePositions[lastSeenPeoplePositions.size() - 1];
-      lastSeenPeoplePositions[i] = t;
-    }
-    lastSeenPeoplePositions.pop_back();
-  }
-  
   bool LegDetector::isPointNearToLimits(Point p)
   {
     return (std::abs(p.x - x_upper_limit) > 0.1 || 
@@ -1912,23 +2660,15 @@ void LegDetector::init()
   
   void LegDetector::updateLastSeenPeoplePositions()
   {
-    for (int i = 0; i < lastSeenPeoplePositions.size(); i++)
+    std::vector<int> evicted_ids, evicted_leg_ids;
+    lost_legs.evict(current_stamp.toSec(), evicted_leg_ids);
+    lost_people.evict(current_stamp.toSec(), evicted_ids);
+    for (int i = 0; i < evicted_ids.size(); i++)
     {
-      if (std::get<0>(lastSeenPeoplePositions[i]) * frequency > 5.0
-	|| (std::get<0>(lastSeenPeoplePositions[i]) * frequency > 1.0 
-	    && isPointNearToLimits(std::get<2>(lastSeenPeoplePositions[i])))) 
-      { 
-	int pId = std::get<1>(lastSeenPeoplePositions[i]);
-	std::map<int, visualization_msgs::Marker>::iterator it = paths.find(pId);
-	if (it != paths.end())
-	{
-	  paths.erase(it);
-	}
-	removeLastSeenPeoplePosition(i);
-      } 
-      else
+      std::map<int, visualization_msgs::Marker>::iterator it = paths.find(evicted_ids[i]);
+      if (it != paths.end())
       {
-	std::get<0>(lastSeenPeoplePositions[i])++;
+	paths.erase(it);
       }
     }
   }
@@ -1998,49 +2738,118 @@ void LegDetector::init()
 
   void LegDetector::resetLeftRight()
   {
-    left_right = std::make_pair(-1, -1);
-    ij_or_ji = std::make_pair(0, 0);
-    conf_left_right = 0.01;
+    for (std::map<int, Person>::iterator it = persons.begin(); it != persons.end(); it++)
+    {
+      it->second.getGait().reset();
+    }
   }
   
-  leg_tracker::LegMsg LegDetector::getLegMsg(int leg_index)
+  leg_tracker::LegMsg LegDetector::getLegMsg(const Tombstone& removed_leg)
+  {
+    leg_tracker::LegMsg legMsg;
+    legMsg.ID = removed_leg.legId;
+    legMsg.confidence = 0.;
+    legMsg.position.x = removed_leg.x;
+    legMsg.position.y = removed_leg.y;
+    legMsg.velocity.x = removed_leg.vel_x;
+    legMsg.velocity.y = removed_leg.vel_y;
+    legMsg.side = getLegSide(removed_leg.peopleId, removed_leg.legId);
+    return legMsg;
+  }
+
+  leg_tracker::LegMsg LegDetector::getLegMsg(Leg& leg)
   {
     leg_tracker::LegMsg legMsg;
-    legMsg.ID = legs[leg_index].getLegId();
-    legMsg.confidence = legs[leg_index].getConfidence();
-    legMsg.position.x = legs[leg_index].getPos().x;
-    legMsg.position.y = legs[leg_index].getPos().y;
-    legMsg.velocity.x = legs[leg_index].getVel().x;
-    legMsg.velocity.y = legs[leg_index].getVel().y;
-    legMsg.acceleration.x = legs[leg_index].getAcc().x;
-    legMsg.acceleration.y = legs[leg_index].getAcc().y;
+    legMsg.ID = leg.getLegId();
+    legMsg.confidence = leg.getConfidence();
+    legMsg.position.x = leg.getPos().x;
+    legMsg.position.y = leg.getPos().y;
+    legMsg.velocity.x = leg.getVel().x;
+    legMsg.velocity.y = leg.getVel().y;
+    legMsg.acceleration.x = leg.getAcc().x;
+    legMsg.acceleration.y = leg.getAcc().y;
+    legMsg.side = getLegSide(leg.getPeopleId(), leg.getLegId());
     return legMsg;
   }
   
-  void LegDetector::publish_person_msg_stamped(int fst_leg_index, int snd_leg_index, std_msgs::Header header) {
+  void LegDetector::publish_person_msg_stamped(int peopleId, const leg_tracker::LegMsg& leg1, 
+						const leg_tracker::LegMsg& leg2, std_msgs::Header header) {
     leg_tracker::PersonMsg msg;
     msg.header = header;
-    msg.ID = legs[fst_leg_index].getPeopleId();
-    msg.leg1 = getLegMsg(fst_leg_index);
-    msg.leg2 = getLegMsg(snd_leg_index);
+    msg.ID = peopleId;
+    msg.leg1 = leg1;
+    msg.leg2 = leg2;
+    std::map<int, Person>::iterator it = persons.find(peopleId);
+    if (it != persons.end())
+    {
+      msg.position.x = it->second.getX();
+      msg.position.y = it->second.getY();
+      msg.velocity.x = it->second.getVelX();
+      msg.velocity.y = it->second.getVelY();
+      msg.heading = it->second.getHeading();
+    }
+    else
+    {
+      msg.position.x = (leg1.position.x + leg2.position.x) / 2;
+      msg.position.y = (leg1.position.y + leg2.position.y) / 2;
+    }
     people_msg_pub.publish(msg);
   }
 
-  void LegDetector::processLaserScan(const sensor_msgs::LaserScan::ConstPtr& scan)
+  void LegDetector::processPointCloud(const sensor_msgs::PointCloud2::ConstPtr& cloud)
   {
+    // the band is taken in the frame of the cloud, assuming the lidar is mounted level
+    std::string frame_id = cloud->header.frame_id;
+    if (frame_id.size() != 0 && frame_id[0] == '/') { frame_id.replace(0, 1, ""); }
+    geometry_msgs::TransformStamped transformStamped;
+    try{
+      transformStamped = tfBuffer.lookupTransform(transform_link, frame_id, ros::Time(0));
+    }
+    catch (tf2::TransformException &ex) {
+      ROS_WARN_THROTTLE(5., "Height band: %s", ex.what());
+      return;
+    }
+    
+    sensor_msgs::LaserScan::Ptr scan(new sensor_msgs::LaserScan());
+    if (!heightBandToScan(*cloud, transformStamped.transform.translation.z, z_coordinate - cloud_band_height / 2., 
+      z_coordinate + cloud_band_height / 2., cloud_angle_increment, cloud_range_min, cloud_range_max, *scan)) 
+    { 
+      ROS_WARN_THROTTLE(5., "Height band: invalid cloud_angle_increment %f", cloud_angle_increment);
+      return; 
+    }
+    if (pipelined) { queueLaserScan(scan); }
+    else { processLaserScan(scan); }
+  }
+
+  void LegDetector::setScanStats(const ScanClock& clock)
+  {
+    scan_period = clock.getPeriod();
+    frame_stats.scan_period = clock.getPeriod();
+    frame_stats.dropped_scans = clock.getDropped();
+    frame_stats.late_scans = clock.getLate();
+  }
+
+  bool LegDetector::beginFrame(const ros::Time& stamp)
+  {
+    current_stamp = stamp;
+    frame_stats.filter_time = 0.;
+    // ages advance with the newest stamp so far, a late scan of the fused input adds nothing
+    double frame_dt = newest_frame_stamp.isZero() ? 0. : std::max(0., (stamp - newest_frame_stamp).toSec());
+    if (stamp > newest_frame_stamp) { newest_frame_stamp = stamp; }
     updateLastSeenPeoplePositions();
+    predictPersons();
     
-    if (isOnePersonToTrack && waitForTrackingZoneReset * frequency > 5.0) 
+    if (isOnePersonToTrack && waitForTrackingZoneReset > 5.0) 
     {
       resetLeftRight();
       resetTrackingZone();
       waitForTrackingZoneReset = 0;
     }
-    if (isOnePersonToTrack) { waitForTrackingZoneReset++; }
+    if (isOnePersonToTrack) { waitForTrackingZoneReset += frame_dt; }
     
     for (int i = 0; i < tracking_zones.size(); i++)
     {
-      tracking_zones[i].incrementWithoutUpdate();
+      tracking_zones[i].incrementWithoutUpdate(frame_dt);
       if (tracking_zones[i].isWithoutUpdate())
       {
 	tracking_zones.erase(tracking_zones.begin() + i);
@@ -2050,8 +2859,19 @@ void LegDetector::init()
 //     ros::Time lasttime=ros::Time::now();
     
     if (with_map) {
-      if (!got_map) { return; }
+      if (!got_map) { return false; }
     }
+    return true;
+  }
+
+  void LegDetector::processLaserScan(const sensor_msgs::LaserScan::ConstPtr& scan)
+  {
+    std::lock_guard<std::mutex> lock(tracking_mutex);
+    scan_clock.tick(scan->header.stamp.toSec());
+    setScanStats(scan_clock);
+    if (!beginFrame(scan->header.stamp)) { return; }
+    
+    if (isSceneIdle(*scan)) { predictLegs(); return; }
     
     pub_border_square();
     
@@ -2059,23 +2879,242 @@ void LegDetector::init()
     
     sensor_msgs::PointCloud2 cloudFromScan, tfTransformedCloud;
 
-    if (!laserScanToPointCloud2(scan, cloudFromScan)) { predictLegs(); return; }
+    clustering_start = ros::WallTime::now();
+    
+    // static beams are masked on a copy of the scan, the projection drops them
+    sensor_msgs::LaserScan::ConstPtr working_scan = scan;
+    if (background_subtraction || (with_map && map_ray_casting) || attention_mode)
+    {
+      sensor_msgs::LaserScan::Ptr masked_scan(new sensor_msgs::LaserScan(*scan));
+      maskStaticBeams(*masked_scan);
+      if (attention_mode) { maskBeamsOutsideAttention(*masked_scan); }
+      working_scan = masked_scan;
+    }
 
-    if (!tfTransformOfPointCloud2(scan, cloudFromScan, tfTransformedCloud)) { predictLegs(); return; }
+    std_msgs::Header header;
+    header.stamp = scan->header.stamp;
+    header.frame_id = transform_link;
+    frame_stats.reprocessed_fraction = 1.;
+    frame_stats.degradation_level = leg_tracker::FrameStats::FULL;
+    
+    if (clustering_time_budget > 0. && degradation_level != leg_tracker::FrameStats::FULL)
+    {
+      working_scan = degradeScan(*working_scan);
+    }
 
-    pcl::PCLPointCloud2::Ptr pcl_pc2 (new pcl::PCLPointCloud2());
+    PointCloud cluster_centroids;
+    
+    if (clustering_mode == "scan_order")
+    {
+      if (!scanOrderClustering(*working_scan, cluster_centroids)) { predictLegs(); return; }
+    }
+    else
+    {
+      if (!laserScanToPointCloud2(working_scan, cloudFromScan)) { predictLegs(); return; }
 
-    pcl_conversions::toPCL(tfTransformedCloud, *pcl_pc2);
+      if (!tfTransformOfPointCloud2(scan, cloudFromScan, tfTransformedCloud)) { predictLegs(); return; }
+
+      pcl::PCLPointCloud2::Ptr pcl_pc2 (new pcl::PCLPointCloud2());
+
+      pcl_conversions::toPCL(tfTransformedCloud, *pcl_pc2);
+
+      PointCloud cloudXYZ, filteredCloudXYZ;
+      pcl::fromPCLPointCloud2(*pcl_pc2, cloudXYZ);
+      if (arc_length_decimation) { decimateByArcLength(cloudXYZ); }
+      filteredCloudXYZ.header = cloudXYZ.header;
+      if (!filterPCLPointCloud(cloudXYZ, filteredCloudXYZ)) { predictLegs(); return; }
+
+      if (!clustering(filteredCloudXYZ, cluster_centroids)) { predictLegs(); return; }
+    }
+    updateDegradationLevel();
+    trackClusterCentroids(header, cluster_centroids);
+  }
 
-    PointCloud cloudXYZ, filteredCloudXYZ;
+  // projection, filtering and cluster extraction of a scan outside the tracking thread, 
+  // cloud and cluster_indices are cleared if the scan has no clusters
+  void LegDetector::extractSensorClusters(const sensor_msgs::LaserScan::ConstPtr& scan, 
+					  laser_geometry::LaserProjection& projector, PointCloud& cloud, 
+					  std::vector<pcl::PointIndices>& cluster_indices)
+  {
+    sensor_msgs::PointCloud2 cloudFromScan, tfTransformedCloud;
+    PointCloud cloudXYZ;
+    cloud.clear();
+    cluster_indices.clear();
+    
+    projector.projectLaser(*scan, cloudFromScan);
+    if (!tfTransformOfPointCloud2(scan, cloudFromScan, tfTransformedCloud)) { return; }
+    pcl::PCLPointCloud2::Ptr pcl_pc2 (new pcl::PCLPointCloud2());
+    pcl_conversions::toPCL(tfTransformedCloud, *pcl_pc2);
     pcl::fromPCLPointCloud2(*pcl_pc2, cloudXYZ);
-    filteredCloudXYZ.header = cloudXYZ.header;
-    if (!filterPCLPointCloud(cloudXYZ, filteredCloudXYZ)) { predictLegs(); return; }
+    if (arc_length_decimation) { decimateByArcLength(cloudXYZ); }
+    cloud.header = cloudXYZ.header;
+    
+    // the filter reads the map and the limits of the tracked person, otherwise only the parameters
+    std::unique_lock<std::mutex> filter_lock(tracking_mutex, std::defer_lock);
+    if (with_map || isOnePersonToTrack) { filter_lock.lock(); }
+    bool filtered = filterPCLPointCloud(cloudXYZ, cloud);
+    if (filter_lock.owns_lock()) { filter_lock.unlock(); }
+    
+    if (!filtered || !extractClusters(cloud, cluster_indices)) { cluster_indices.clear(); }
+  }
+
+  void LegDetector::processSensorScan(const sensor_msgs::LaserScan::ConstPtr& scan, int index)
+  {
+    ScanSensor& sensor = *scan_sensors[index];
+    PointCloud filteredCloudXYZ;
+    std::vector<pcl::PointIndices> cluster_indices;
+    extractSensorClusters(scan, sensor.projector, filteredCloudXYZ, cluster_indices);
+    setSensorView(sensor, *scan);
+    
+    std::lock_guard<std::mutex> lock(tracking_mutex);
+    sensor.clock.tick(scan->header.stamp.toSec());
+    sensor.latency = (ros::Time::now() - scan->header.stamp).toSec();
+    ROS_DEBUG("Scan of %s: %d clusters, latency %f s", sensor.topic.c_str(), (int) cluster_indices.size(), sensor.latency);
+    
+    // the legs keep their last LegFilter::max_steps states, older scans can not be filtered in
+    double delay = (newest_scan_stamp - scan->header.stamp).toSec();
+    if (delay > max_scan_delay)
+    {
+      ROS_DEBUG("Dropped a scan of %s, %f s older than the newest one", sensor.topic.c_str(), delay);
+      return;
+    }
+    if (delay < 0.) { newest_scan_stamp = scan->header.stamp; }
+    trackSensorScan(sensor, scan->header.stamp, filteredCloudXYZ, cluster_indices);
+  }
+
+  void LegDetector::startPipeline()
+  {
+    if (background_subtraction || (with_map && map_ray_casting) || attention_mode || idle_gate || 
+      clustering_mode == "scan_order" || clustering_time_budget > 0.)
+    {
+      ROS_WARN("pipelined is not supported with background_subtraction, map_ray_casting, attention_mode, "
+	"idle_gate, scan_order clustering or clustering_time_budget, the scans are processed in the callback");
+      pipelined = false;
+      return;
+    }
+    pipeline_sensor.topic = cloud_topic.empty() ? scan_topic : cloud_topic;
+    pipeline_sensor.latency = 0.;
+    pipeline_sensor.clock.reset(frequency);
+    pipeline_sensor.pose.valid = false;
+    pipeline_running = true;
+    clustering_thread = std::thread(&LegDetector::runClusteringStage, this);
+    tracking_thread = std::thread(&LegDetector::runTrackingStage, this);
+  }
+
+  void LegDetector::stopPipeline()
+  {
+    if (!pipeline_running) { return; }
+    pipeline_running = false;
+    notifyPipeline();
+    clustering_thread.join();
+    tracking_thread.join();
+  }
 
+  void LegDetector::notifyPipeline()
+  {
+    // the queue does not lock, taking the mutex orders the change before the predicate check of a waiting stage
+    { std::lock_guard<std::mutex> lock(pipeline_mutex); }
+    pipeline_cv.notify_all();
+  }
+
+  void LegDetector::queueLaserScan(const sensor_msgs::LaserScan::ConstPtr& scan)
+  {
+    {
+      std::lock_guard<std::mutex> lock(pipeline_mutex);
+      // the clustering stage is busy, the newest scan replaces the one still waiting
+      if (pending_scan) { ROS_DEBUG("Pipeline: replaced a scan, the clustering stage is busy"); }
+      pending_scan = scan;
+    }
+    pipeline_cv.notify_all();
+  }
+
+  void LegDetector::runClusteringStage()
+  {
+    while (pipeline_running)
+    {
+      ScanFrame* frame = NULL;
+      {
+	std::unique_lock<std::mutex> lock(pipeline_mutex);
+	pipeline_cv.wait(lock, [this, &frame]() { 
+	  return !pipeline_running || (pending_scan && (frame = frame_queue.beginPush()) != NULL); 
+	});
+	if (!pipeline_running) { break; }
+	frame->scan.swap(pending_scan);
+	pending_scan.reset();
+      }
+      extractSensorClusters(frame->scan, pipeline_sensor.projector, frame->cloud, frame->cluster_indices);
+      frame_queue.commitPush();
+      notifyPipeline();
+    }
+  }
+
+  void LegDetector::runTrackingStage()
+  {
+    while (pipeline_running)
+    {
+      ScanFrame* frame = NULL;
+      {
+	std::unique_lock<std::mutex> lock(pipeline_mutex);
+	pipeline_cv.wait(lock, [this, &frame]() { return !pipeline_running || (frame = frame_queue.front()) != NULL; });
+	if (!pipeline_running) { break; }
+      }
+      // the slot goes back to the clustering stage before tracking, the buffers change hands and keep their capacity
+      tracked_frame.scan.swap(frame->scan);
+      tracked_frame.cloud.swap(frame->cloud);
+      tracked_frame.cluster_indices.swap(frame->cluster_indices);
+      frame->scan.reset();
+      frame_queue.pop();
+      notifyPipeline();
+      {
+	std::lock_guard<std::mutex> lock(tracking_mutex);
+	const sensor_msgs::LaserScan& scan = *tracked_frame.scan;
+	pipeline_sensor.clock.tick(scan.header.stamp.toSec());
+	pipeline_sensor.latency = (ros::Time::now() - scan.header.stamp).toSec();
+	trackSensorScan(pipeline_sensor, scan.header.stamp, tracked_frame.cloud, tracked_frame.cluster_indices);
+      }
+      tracked_frame.scan.reset();
+    }
+  }
+
+  void LegDetector::trackSensorScan(const ScanSensor& sensor, const ros::Time& stamp, 
+				    const PointCloud& cloud, const std::vector<pcl::PointIndices>& cluster_indices)
+  {
+    // legs are predicted to the stamp of the scan, back in time for a late one
+    setScanStats(sensor.clock);
+    if (!beginFrame(stamp)) { return; }
+    pub_border_square();
+    deleteOldMarkers();
+    
+    std_msgs::Header header;
+    header.stamp = stamp;
+    header.frame_id = transform_link;
+    frame_stats.reprocessed_fraction = 1.;
+    frame_stats.degradation_level = leg_tracker::FrameStats::FULL;
+    frame_stats.degraded = false;
+    frame_stats.clustering_time = 0.;
+    frame_stats.sensors.assign(1, sensor.topic);
+    frame_stats.sensor_latencies.assign(1, sensor.latency);
+    
     PointCloud cluster_centroids;
+    pcl_conversions::toPCL(header, cluster_centroids.header);
+    clustering_start = ros::WallTime::now();
+    collectLegSeeds();
+    for (int k = 0; k < cluster_indices.size(); k++)
+    {
+      ClusterMoments m;
+      computeClusterMoments(cloud, cluster_indices[k].indices, m);
+      addClusterCenters(cloud, cluster_indices[k].indices, m, cluster_centroids);
+    }
+    reportClassification();
     
-    if (!clustering(filteredCloudXYZ, cluster_centroids)) { predictLegs(); return; }
-    if (cluster_centroids.points.size() == 0) { predictLegs(); return; }
+    view_sensor = &sensor;
+    trackClusterCentroids(header, cluster_centroids);
+    view_sensor = NULL;
+  }
+
+  void LegDetector::trackClusterCentroids(const std_msgs::Header& header, PointCloud& cluster_centroids)
+  {
+    if (cluster_centroids.points.size() == 0) { predictLegs(); publishFrameStats(header); return; }
 
     if (isOnePersonToTrack) 
     {
@@ -2091,9 +3130,7 @@ void LegDetector::init()
     }
     visLegs();
     findPeople();
-    std_msgs::Header header;
-    header.stamp = scan->header.stamp;
-    header.frame_id = transform_link;
+    updatePersons();
     if (isOnePersonToTrack && legs.size() == 2)
     {
       std::vector<double> current_state;
@@ -2117,7 +3154,71 @@ void LegDetector::init()
 //       double n2 = calculateNorm(legs[1].getPos());
 //     }
     vis_tracking_zones();
+    publishFrameStats(header);
 //     ros::Time currtime=ros::Time::now();
 //     ros::Duration diff=currtime-lasttime;
     if (isOnePersonToTrack) { waitForTrackingZoneReset = 0; }
   }
+
+  sensor_msgs::LaserScan::Ptr LegDetector::degradeScan(const sensor_msgs::LaserScan& scan)
+  {
+    frame_stats.degradation_level = degradation_level;
+    sensor_msgs::LaserScan::Ptr degraded(new sensor_msgs::LaserScan(scan));
+    
+    // every second beam only
+    degraded->angle_increment = 2 * scan.angle_increment;
+    degraded->ranges.clear();
+    degraded->intensities.clear();
+    for (int i = 0; i < scan.ranges.size(); i += 2)
+    {
+      degraded->ranges.push_back(scan.ranges[i]);
+      if (i < scan.intensities.size()) { degraded->intensities.push_back(scan.intensities[i]); }
+    }
+    degraded->angle_max = degraded->angle_min + (degraded->ranges.size() - 1) * degraded->angle_increment;
+    degraded->time_increment = 2 * scan.time_increment;
+    
+    if (degradation_level >= leg_tracker::FrameStats::NEAR_ONLY)
+    {
+      for (int i = 0; i < degraded->ranges.size(); i++)
+      {
+	if (degraded->ranges[i] > clustering_far_range) 
+	{ 
+	  degraded->ranges[i] = std::numeric_limits<float>::quiet_NaN(); 
+	}
+      }
+    }
+    return degraded;
+  }
+
+  bool LegDetector::isClusteringOverBudget()
+  {
+    if (clustering_time_budget <= 0.) { return false; }
+    if ((ros::WallTime::now() - clustering_start).toSec() <= clustering_time_budget) { return false; }
+    frame_stats.degradation_level = leg_tracker::FrameStats::NEAR_ONLY;
+    return true;
+  }
+
+  void LegDetector::updateDegradationLevel()
+  {
+    frame_stats.clustering_time = (ros::WallTime::now() - clustering_start).toSec();
+    frame_stats.degraded = frame_stats.degradation_level != leg_tracker::FrameStats::FULL;
+    if (clustering_time_budget <= 0.) { return; }
+    
+    // one level coarser after a frame over budget, one level finer after a frame well within it
+    if (frame_stats.clustering_time > clustering_time_budget && degradation_level < leg_tracker::FrameStats::NEAR_ONLY)
+    {
+      degradation_level++;
+      ROS_DEBUG("Clustering took %f s, degradation level %d", frame_stats.clustering_time, degradation_level);
+    }
+    else if (frame_stats.clustering_time < 0.5 * clustering_time_budget && degradation_level > leg_tracker::FrameStats::FULL)
+    {
+      degradation_level--;
+    }
+  }
+
+  void LegDetector::publishFrameStats(const std_msgs::Header& header)
+  {
+    frame_stats.header = header;
+    ROS_DEBUG("Leg filter: %f us for %d legs", 1e6 * frame_stats.filter_time, (int) legs.size());
+    frame_stats_pub.publish(frame_stats);
+  }